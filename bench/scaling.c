@@ -0,0 +1,82 @@
+// Measures w_malloc/w_free throughput as the number of threads grows.
+//
+// Usage: ./bench_scaling [max_threads]
+//
+// Each thread keeps a small window of live blocks and replaces a random one
+// on every iteration, so the workload is a steady mix of mallocs and frees.
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../watchdog.h"
+
+#define OPS_PER_THREAD 200000
+#define LIVE_WINDOW 64
+
+static void* worker(void* arg) {
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  void* live[LIVE_WINDOW] = {0};
+
+  for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+    size_t slot = rand_r(&seed) % LIVE_WINDOW;
+    if (live[slot]) {
+      w_free(live[slot], __FILE__, __LINE__, __func__);
+    }
+    live[slot] =
+        w_malloc(16 + rand_r(&seed) % 240, __FILE__, __LINE__, __func__);
+  }
+  for (size_t slot = 0; slot < LIVE_WINDOW; slot++) {
+    if (live[slot]) {
+      w_free(live[slot], __FILE__, __LINE__, __func__);
+    }
+  }
+  return NULL;
+}
+
+static double run(int threads) {
+  pthread_t* ids = calloc((size_t)threads, sizeof *ids);
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int t = 0; t < threads; t++) {
+    pthread_create(&ids[t], NULL, worker, (void*)(uintptr_t)(t + 1));
+  }
+  for (int t = 0; t < threads; t++) {
+    pthread_join(ids[t], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(ids);
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  // Every iteration is one malloc and (after warm-up) one free.
+  return 2.0 * OPS_PER_THREAD * threads / seconds;
+}
+
+int main(int argc, char** argv) {
+  int max_threads = argc > 1 ? atoi(argv[1])
+                             : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  w_init(false, false, false);
+
+  printf("%8s %16s %10s\n", "threads", "ops/sec", "speedup");
+  double baseline = 0;
+  for (int threads = 1; threads <= max_threads;
+       threads = threads < max_threads && threads * 2 > max_threads
+                     ? max_threads
+                     : threads * 2) {
+    double ops = run(threads);
+    if (threads == 1) {
+      baseline = ops;
+    }
+    printf("%8d %16.0f %9.2fx\n", threads, ops, ops / baseline);
+    fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,494 @@
+// Measures watchdog's overhead against the system allocator on several
+// allocation patterns.
+//
+// Usage: ./bench_suite [-w WORKLOAD] [-m MODE] [-t THREADS] [-s SCALE]
+//
+//   -w WORKLOAD  run only this workload (see `workloads` below)
+//   -m MODE      run only this mode (see `modes` below)
+//   -t THREADS   worker threads per workload (default: online CPUs, up to 4)
+//   -s SCALE     multiply the number of operations by SCALE (default 1)
+//
+// Every (workload, mode) pair runs in a forked child, so watchdog starts from
+// a clean state and the child's peak RSS belongs to that run alone. Results
+// are printed as CSV, one row per run. Latency is sampled on one operation in
+// LATENCY_SAMPLE_EVERY; ops/sec covers all of them. Verbose modes log to
+// watchdog.log or watchdog.trace, which are deleted after each run.
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../watchdog.h"
+
+#define LATENCY_SAMPLE_EVERY 16
+#define MAX_THREADS 64
+
+// Each workload calls the allocator through these, so every line below is
+// its own watchdog call site.
+#define BENCH_MALLOC(size)                                     \
+  (use_watchdog ? w_malloc(size, __FILE__, __LINE__, __func__) \
+                : malloc(size))
+#define BENCH_REALLOC(ptr, size)                                     \
+  (use_watchdog ? w_realloc(ptr, size, __FILE__, __LINE__, __func__) \
+                : realloc(ptr, size))
+#define BENCH_FREE(ptr) \
+  (use_watchdog ? w_free(ptr, __FILE__, __LINE__, __func__) : free(ptr))
+
+// Runs `stmt`, timing it if operation `i` is one of the sampled ones.
+#define TIMED(samples, i, stmt)                      \
+  do {                                               \
+    if ((i) % LATENCY_SAMPLE_EVERY == 0) {           \
+      uint64_t timed_start_ = now_ns();              \
+      stmt;                                          \
+      samples_add(samples, now_ns() - timed_start_); \
+    } else {                                         \
+      stmt;                                          \
+    }                                                \
+  } while (0)
+
+typedef struct {
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} Samples;
+
+typedef struct {
+  int id;
+  size_t scale;
+  size_t ops;
+  Samples samples;
+  void* peer;  // producer/consumer: the queue shared with the other thread
+} Worker;
+
+typedef struct {
+  const char* name;
+  void* (*run)(void* arg);
+  int (*threads)(int requested);
+} Workload;
+
+typedef struct {
+  const char* name;
+  bool watchdog;
+  bool verbose;
+  WatchdogLogMode log_mode;
+  WatchdogLogFormat log_format;
+  size_t thread_cache_bytes;
+} Mode;
+
+// Sent from the child that ran a benchmark to the parent.
+typedef struct {
+  size_t ops;
+  double seconds;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} Result;
+
+static bool use_watchdog = false;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void samples_add(Samples* samples, uint64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 4096;
+    samples->values =
+        realloc(samples->values, samples->capacity * sizeof *samples->values);
+    if (!samples->values) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const Samples* samples, double quantile) {
+  if (!samples->count) {
+    return 0;
+  }
+  size_t rank = (size_t)(quantile * (double)(samples->count - 1) + 0.5);
+  return samples->values[rank];
+}
+
+static size_t random_size(unsigned int* seed, size_t min, size_t max) {
+  return min + (size_t)rand_r(seed) % (max - min + 1);
+}
+
+//------------------------------------------------------------------------------
+// Workloads
+//------------------------------------------------------------------------------
+
+// Small objects replaced at random in a window of live blocks.
+#define CHURN_OPS 100000
+#define CHURN_WINDOW 256
+
+static void* churn(void* arg) {
+  Worker* worker = arg;
+  unsigned int seed = (unsigned int)worker->id + 1;
+  void* live[CHURN_WINDOW] = {0};
+  size_t ops = CHURN_OPS * worker->scale;
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = (size_t)rand_r(&seed) % CHURN_WINDOW;
+    if (live[slot]) {
+      TIMED(&worker->samples, worker->ops, BENCH_FREE(live[slot]));
+      worker->ops++;
+    }
+    size_t size = random_size(&seed, 8, 128);
+    TIMED(&worker->samples, worker->ops, live[slot] = BENCH_MALLOC(size));
+    worker->ops++;
+  }
+  for (size_t slot = 0; slot < CHURN_WINDOW; slot++) {
+    if (live[slot]) {
+      BENCH_FREE(live[slot]);
+      worker->ops++;
+    }
+  }
+  return NULL;
+}
+
+// Blocks of mixed sizes allocated on one thread and freed on another,
+// passed through a single-producer/single-consumer queue.
+#define HANDOFF_OPS 100000
+#define HANDOFF_QUEUE 1024
+
+typedef struct {
+  void* slots[HANDOFF_QUEUE];
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+} Queue;
+
+static void* producer_consumer(void* arg) {
+  Worker* worker = arg;
+  Queue* queue = worker->peer;
+  size_t count = HANDOFF_OPS * worker->scale;
+  if (worker->id % 2 == 0) {
+    unsigned int seed = (unsigned int)worker->id + 1;
+    for (size_t i = 0; i < count; i++) {
+      // Mostly small messages with an occasional large one.
+      size_t size = rand_r(&seed) % 16 ? random_size(&seed, 16, 512)
+                                       : random_size(&seed, 512, 16384);
+      void* block;
+      TIMED(&worker->samples, worker->ops, block = BENCH_MALLOC(size));
+      worker->ops++;
+      *(volatile char*)block = (char)i;
+      size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+      while (head - atomic_load_explicit(&queue->tail, memory_order_acquire) ==
+             HANDOFF_QUEUE) {
+        sched_yield();
+      }
+      queue->slots[head % HANDOFF_QUEUE] = block;
+      atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    }
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+      while (atomic_load_explicit(&queue->head, memory_order_acquire) ==
+             tail) {
+        sched_yield();
+      }
+      void* block = queue->slots[tail % HANDOFF_QUEUE];
+      atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+      TIMED(&worker->samples, worker->ops, BENCH_FREE(block));
+      worker->ops++;
+    }
+  }
+  return NULL;
+}
+
+// Buffers grown by half again at a time, as by a vector or string builder.
+#define GROWTH_ROUNDS 2000
+#define GROWTH_LIMIT 65536
+
+static void* realloc_growth(void* arg) {
+  Worker* worker = arg;
+  size_t rounds = GROWTH_ROUNDS * worker->scale;
+  for (size_t round = 0; round < rounds; round++) {
+    char* buffer = NULL;
+    for (size_t size = 16; size <= GROWTH_LIMIT; size += size / 2) {
+      TIMED(&worker->samples, worker->ops,
+            buffer = BENCH_REALLOC(buffer, size));
+      worker->ops++;
+      buffer[size - 1] = 0;
+    }
+    TIMED(&worker->samples, worker->ops, BENCH_FREE(buffer));
+    worker->ops++;
+  }
+  return NULL;
+}
+
+// A large heap of long-lived blocks with random ones replaced, so the
+// tracking tables stay big while allocations and frees continue.
+#define HEAP_BLOCKS 16384
+#define HEAP_OPS 100000
+
+static void* long_lived(void* arg) {
+  Worker* worker = arg;
+  unsigned int seed = (unsigned int)worker->id + 1;
+  void** heap = calloc(HEAP_BLOCKS, sizeof *heap);
+  for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+    size_t size = random_size(&seed, 16, 1024);
+    TIMED(&worker->samples, worker->ops, heap[i] = BENCH_MALLOC(size));
+    worker->ops++;
+  }
+  size_t ops = HEAP_OPS * worker->scale;
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = (size_t)rand_r(&seed) % HEAP_BLOCKS;
+    TIMED(&worker->samples, worker->ops, BENCH_FREE(heap[slot]));
+    worker->ops++;
+    size_t size = random_size(&seed, 16, 1024);
+    TIMED(&worker->samples, worker->ops, heap[slot] = BENCH_MALLOC(size));
+    worker->ops++;
+  }
+  for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+    BENCH_FREE(heap[i]);
+    worker->ops++;
+  }
+  free(heap);
+  return NULL;
+}
+
+// Blocks from 64 KiB to 2 MiB, above the system allocator's mmap threshold.
+#define LARGE_OPS 5000
+#define LARGE_WINDOW 16
+
+static void* large_blocks(void* arg) {
+  Worker* worker = arg;
+  unsigned int seed = (unsigned int)worker->id + 1;
+  char* live[LARGE_WINDOW] = {0};
+  size_t ops = LARGE_OPS * worker->scale;
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = (size_t)rand_r(&seed) % LARGE_WINDOW;
+    if (live[slot]) {
+      TIMED(&worker->samples, worker->ops, BENCH_FREE(live[slot]));
+      worker->ops++;
+    }
+    size_t size = random_size(&seed, 64 << 10, 2 << 20);
+    TIMED(&worker->samples, worker->ops, live[slot] = BENCH_MALLOC(size));
+    worker->ops++;
+    live[slot][0] = live[slot][size - 1] = 1;
+  }
+  for (size_t slot = 0; slot < LARGE_WINDOW; slot++) {
+    if (live[slot]) {
+      BENCH_FREE(live[slot]);
+      worker->ops++;
+    }
+  }
+  return NULL;
+}
+
+static int any_threads(int requested) { return requested; }
+
+// Producers and consumers come in pairs.
+static int paired_threads(int requested) {
+  return requested < 2 ? 2 : requested & ~1;
+}
+
+static const Workload workloads[] = {
+    {"churn", churn, any_threads},
+    {"producer_consumer", producer_consumer, paired_threads},
+    {"realloc_growth", realloc_growth, any_threads},
+    {"long_lived", long_lived, any_threads},
+    {"large_blocks", large_blocks, any_threads},
+};
+
+static const Mode modes[] = {
+    {"system", false, false, WATCHDOG_LOG_SYNC, WATCHDOG_FORMAT_TEXT, 0},
+    {"quiet", true, false, WATCHDOG_LOG_SYNC, WATCHDOG_FORMAT_TEXT, 0},
+    {"sync", true, true, WATCHDOG_LOG_SYNC, WATCHDOG_FORMAT_TEXT, 0},
+    {"async", true, true, WATCHDOG_LOG_ASYNC, WATCHDOG_FORMAT_TEXT, 0},
+    {"binary", true, true, WATCHDOG_LOG_ASYNC, WATCHDOG_FORMAT_BINARY, 0},
+    {"cached", true, false, WATCHDOG_LOG_SYNC, WATCHDOG_FORMAT_TEXT, 1 << 20},
+};
+
+#define COUNT(array) (sizeof(array) / sizeof *(array))
+
+//------------------------------------------------------------------------------
+// Driver
+//------------------------------------------------------------------------------
+
+static Result run(const Workload* workload, const Mode* mode, int threads,
+                  size_t scale) {
+  if (mode->watchdog) {
+    WatchdogOptions options = w_default_options();
+    options.enable_verbose_log = mode->verbose;
+    options.log_to_file = true;
+    options.log_mode = mode->log_mode;
+    options.ring_full_policy = WATCHDOG_RING_BLOCK;
+    options.log_format = mode->log_format;
+    options.thread_cache_bytes = mode->thread_cache_bytes;
+    w_init_with_options(&options);
+    use_watchdog = true;
+  }
+
+  Worker workers[MAX_THREADS] = {0};
+  pthread_t ids[MAX_THREADS];
+  Queue* queues = calloc((size_t)threads, sizeof *queues);
+  for (int t = 0; t < threads; t++) {
+    workers[t].id = t;
+    workers[t].scale = scale;
+    workers[t].peer = &queues[t / 2];
+  }
+
+  uint64_t start = now_ns();
+  for (int t = 0; t < threads; t++) {
+    pthread_create(&ids[t], NULL, workload->run, &workers[t]);
+  }
+  for (int t = 0; t < threads; t++) {
+    pthread_join(ids[t], NULL);
+  }
+  Result result = {.seconds = (now_ns() - start) * 1e-9};
+  free(queues);
+
+  Samples all = {0};
+  for (int t = 0; t < threads; t++) {
+    result.ops += workers[t].ops;
+    for (size_t i = 0; i < workers[t].samples.count; i++) {
+      samples_add(&all, workers[t].samples.values[i]);
+    }
+    free(workers[t].samples.values);
+  }
+  qsort(all.values, all.count, sizeof *all.values, compare_u64);
+  result.p50 = percentile(&all, 0.5);
+  result.p90 = percentile(&all, 0.9);
+  result.p99 = percentile(&all, 0.99);
+  result.p999 = percentile(&all, 0.999);
+  result.max = all.count ? all.values[all.count - 1] : 0;
+  free(all.values);
+  return result;
+}
+
+// Runs one benchmark in a child process. Returns false if it failed.
+static bool run_isolated(const Workload* workload, const Mode* mode,
+                         int threads, size_t scale, Result* result,
+                         long* max_rss_kb) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    perror("pipe");
+    return false;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    Result child = run(workload, mode, threads, scale);
+    ssize_t written = write(pipe_fds[1], &child, sizeof child);
+    close(pipe_fds[1]);
+    // exit() rather than _exit(), so watchdog writes its report and closes
+    // the trace like it would in a real program.
+    exit(written == (ssize_t)sizeof child ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  close(pipe_fds[1]);
+  ssize_t received = read(pipe_fds[0], result, sizeof *result);
+  close(pipe_fds[0]);
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  *max_rss_kb = usage.ru_maxrss;
+  unlink("watchdog.log");
+  unlink("watchdog.trace");
+  return received == (ssize_t)sizeof *result && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [-w WORKLOAD] [-m MODE] [-t THREADS] [-s SCALE]\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  const char* only_workload = NULL;
+  const char* only_mode = NULL;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > 4) {
+    threads = 4;
+  }
+  size_t scale = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:m:t:s:")) != -1) {
+    switch (opt) {
+      case 'w':
+        only_workload = optarg;
+        break;
+      case 'm':
+        only_mode = optarg;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 's':
+        scale = (size_t)strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (threads < 1 || threads > MAX_THREADS || scale < 1) {
+    usage(argv[0]);
+  }
+
+  printf("workload,mode,threads,ops,seconds,ops_per_sec,p50_ns,p90_ns,"
+         "p99_ns,p999_ns,max_ns,max_rss_kb,rss_vs_system\n");
+  for (size_t w = 0; w < COUNT(workloads); w++) {
+    const Workload* workload = &workloads[w];
+    if (only_workload && strcmp(only_workload, workload->name) != 0) {
+      continue;
+    }
+    int workload_threads = workload->threads(threads);
+    long system_rss_kb = 0;
+    for (size_t m = 0; m < COUNT(modes); m++) {
+      const Mode* mode = &modes[m];
+      if (only_mode && strcmp(only_mode, mode->name) != 0) {
+        continue;
+      }
+      Result result;
+      long max_rss_kb;
+      if (!run_isolated(workload, mode, workload_threads, scale, &result,
+                        &max_rss_kb)) {
+        fprintf(stderr, "%s/%s: benchmark failed\n", workload->name,
+                mode->name);
+        continue;
+      }
+      if (!mode->watchdog) {
+        system_rss_kb = max_rss_kb;
+      }
+      printf("%s,%s,%d,%zu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%ld,",
+             workload->name, mode->name, workload_threads, result.ops,
+             result.seconds, result.ops / result.seconds,
+             (unsigned long long)result.p50, (unsigned long long)result.p90,
+             (unsigned long long)result.p99, (unsigned long long)result.p999,
+             (unsigned long long)result.max, max_rss_kb);
+      if (system_rss_kb) {
+        printf("%.2f\n", (double)max_rss_kb / system_rss_kb);
+      } else {
+        printf("\n");
+      }
+      fflush(stdout);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,316 @@
+#define WATCHDOG_ENABLE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../watchdog.h"
+
+// Regression scenarios, one per run: ./features <scenario>. Most options
+// only apply at the first initialization, so every scenario gets a process of
+// its own. tests/test_runner.py checks what each one prints.
+
+#define BLOCK_COUNT 20000
+
+static void* blocks[BLOCK_COUNT];
+
+static WatchdogOptions quiet_options(void);
+static void index_test(void);
+static char* freed_alloc_site(void);
+static void freed_free_site(char* buffer);
+static void freed_test(void);
+static void bounds_test(void);
+static void sampling_test(void);
+static void quarantine_test(void);
+static void guard_test(void);
+static void leak_site_a(size_t size);
+static void leak_site_b(size_t size);
+static void leaks_test(void);
+static void presets_test(void);
+static void cache_test(void);
+static void* snapshot_grow(void);
+static void snapshot_test(void);
+static void* short_lived_site(void);
+static void* moved_block_site(void);
+static void lifetimes_test(void);
+static void trace_test(void);
+static void inline_test(void);
+
+static const struct {
+  const char* name;
+  void (*run)(void);
+} scenarios[] = {
+    {"index", index_test},
+    {"freed", freed_test},
+    {"bounds", bounds_test},
+    {"sampling", sampling_test},
+    {"quarantine", quarantine_test},
+    {"guard", guard_test},
+    {"leaks", leaks_test},
+    {"presets", presets_test},
+    {"cache", cache_test},
+    {"snapshot", snapshot_test},
+    {"lifetimes", lifetimes_test},
+    {"trace", trace_test},
+    {"inline", inline_test},
+};
+
+int main(int argc, char** argv) {
+  for (size_t i = 0; argc == 2 && i < sizeof scenarios / sizeof *scenarios;
+       i++) {
+    if (!strcmp(argv[1], scenarios[i].name)) {
+      scenarios[i].run();
+      return EXIT_SUCCESS;
+    }
+  }
+  fprintf(stderr, "usage: %s <scenario>\n", argv[0]);
+  return EXIT_FAILURE;
+}
+
+// Errors and the report go to stdout, without per-operation events.
+WatchdogOptions quiet_options(void) {
+  WatchdogOptions options = w_default_options();
+  options.enable_verbose_log = false;
+  return options;
+}
+
+void index_test(void) {
+  // Enough live blocks to grow every shard's index several times, then
+  // deletions in between lookups of the survivors.
+  WatchdogOptions options = quiet_options();
+  w_init_with_options(&options);
+  for (size_t i = 0; i < BLOCK_COUNT; i++) {
+    blocks[i] = malloc(i % 64 + 1);
+  }
+  for (size_t i = 1; i < BLOCK_COUNT; i += 2) {
+    free(blocks[i]);
+  }
+  for (size_t i = 0; i < BLOCK_COUNT; i += 2) {
+    blocks[i] = realloc(blocks[i], i % 64 + 1);
+  }
+  for (size_t i = 0; i < BLOCK_COUNT; i += 2) {
+    free(blocks[i]);
+  }
+  printf("index: %zu live blocks\n", w_get_stats().live_allocations);
+}
+
+char* freed_alloc_site(void) { return malloc(24); }
+
+void freed_free_site(char* buffer) { free(buffer); }
+
+void freed_test(void) {
+  WatchdogOptions options = quiet_options();
+  w_init_with_options(&options);
+  char* buffer = freed_alloc_site();
+  freed_free_site(buffer);
+  free(buffer);  // double free
+  buffer = realloc(buffer, 48);  // realloc after free
+}
+
+void bounds_test(void) {
+  WatchdogOptions options = quiet_options();
+  w_init_with_options(&options);
+  char* over = malloc(10);
+  over[12] = 'x';  // end+2
+  free(over);
+  char* under = malloc(10);
+  under[-3] = 'x';  // start-3
+  free(under);
+}
+
+void sampling_test(void) {
+  // Unsampled blocks are tagged, not tracked; freeing them must not look
+  // like freeing untracked memory.
+  WatchdogOptions options = quiet_options();
+  options.sample_rate = 4096;
+  w_init_with_options(&options);
+  for (size_t i = 0; i < BLOCK_COUNT; i++) {
+    blocks[i] = malloc(100);
+  }
+  for (size_t i = 0; i < BLOCK_COUNT; i++) {
+    blocks[i] = realloc(blocks[i], 200);
+  }
+  for (size_t i = 0; i < BLOCK_COUNT; i++) {
+    free(blocks[i]);
+  }
+  printf("sampling: tracked %zu of %d allocations\n",
+         w_get_stats().total_allocations, BLOCK_COUNT);
+}
+
+void quarantine_test(void) {
+  WatchdogOptions options = quiet_options();
+  options.quarantine_bytes = 1 << 20;
+  w_init_with_options(&options);
+  char* freed = malloc(32);
+  free(freed);
+  freed[5] = 'x';  // found when the quarantine is emptied at exit
+  // A realloc that moves the block retires the old one through the
+  // quarantine too.
+  char* old = malloc(16);
+  char* moved = realloc(old, 4096);
+  old[1] = 'y';
+  free(moved);
+}
+
+void guard_test(void) {
+  // The overflow runs into the guard page of a forked child, which must
+  // report it and die of the fault.
+  WatchdogOptions options = quiet_options();
+  options.guard_page_threshold = 64;
+  w_init_with_options(&options);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    volatile char* buffer = malloc(100);
+    for (size_t i = 100;; i++) {
+      buffer[i] = 'x';
+    }
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status)) {
+    printf("guard: child killed by signal %d\n", WTERMSIG(status));
+  } else {
+    printf("guard: child exited with %d\n", WEXITSTATUS(status));
+  }
+}
+
+void leak_site_a(size_t size) { malloc(size); }
+
+void leak_site_b(size_t size) { malloc(size); }
+
+void leaks_test(void) {
+  // Two leaks are listed one per line; all seven are grouped by site.
+  WatchdogOptions options = quiet_options();
+  options.report_leak_details = 2;
+  w_init_with_options(&options);
+  for (size_t size = 10; size <= 50; size += 10) {
+    leak_site_a(size);
+  }
+  leak_site_b(1000);
+  leak_site_b(1000);
+}
+
+void presets_test(void) {
+  // Runs against every WATCHDOG_FEATURES preset, so only what each of them
+  // reports is checked: the counters and errors.
+  WatchdogOptions options = quiet_options();
+  w_init_with_options(&options);
+  char* buffer = malloc(64);
+  buffer = realloc(buffer, 128);
+  int* numbers = calloc(16, sizeof *numbers);
+  free(numbers);
+  free(buffer);
+  int on_stack;
+  free(&on_stack);  // never allocated
+  malloc(48);       // leaked
+}
+
+void cache_test(void) {
+  WatchdogOptions options = quiet_options();
+  options.thread_cache_bytes = 1 << 16;
+  w_init_with_options(&options);
+  for (size_t i = 0; i < 1000; i++) {
+    free(malloc(64));
+  }
+  // A cached block has no record, so a second free is still caught.
+  char* buffer = malloc(64);
+  free(buffer);
+  free(buffer);
+}
+
+void* snapshot_grow(void) { return malloc(100); }
+
+void snapshot_test(void) {
+  WatchdogOptions options = quiet_options();
+  w_init_with_options(&options);
+  void* kept = malloc(10);
+  WatchdogSnapshot* before = w_snapshot();
+  void* grown[3];
+  for (size_t i = 0; i < 3; i++) {
+    grown[i] = snapshot_grow();
+  }
+  WatchdogSnapshot* after = w_snapshot();
+  w_snapshot_diff(before, after);
+  w_snapshot_free(before);
+  w_snapshot_free(after);
+  for (size_t i = 0; i < 3; i++) {
+    free(grown[i]);
+  }
+  free(kept);
+}
+
+void* short_lived_site(void) { return malloc(32); }
+
+void* moved_block_site(void) { return malloc(16); }
+
+void lifetimes_test(void) {
+  WatchdogOptions options = quiet_options();
+  options.lifetime_profile = true;
+  options.guard_page_threshold = 4096;
+  w_init_with_options(&options);
+  for (size_t i = 0; i < 1000; i++) {
+    free(short_lived_site());
+  }
+  // Growing into a guarded block always moves it, which ends its lifetime at
+  // moved_block_site.
+  for (size_t i = 0; i < 100; i++) {
+    void* block = moved_block_site();
+    void* moved = realloc(block, 4096);
+    if (moved == block) {
+      printf("lifetimes: block grew in place\n");
+    }
+    free(moved);
+  }
+}
+
+void trace_test(void) {
+  // Written through the asynchronous logger and decoded by wdtrace. A forked
+  // child logs synchronously and stays out of the trace.
+  WatchdogOptions options = w_default_options();
+  options.log_mode = WATCHDOG_LOG_ASYNC;
+  options.ring_full_policy = WATCHDOG_RING_BLOCK;
+  options.log_format = WATCHDOG_FORMAT_BINARY;
+  options.trace_file = "features.trace";
+  w_init_with_options(&options);
+  void* buffers[5];
+  for (size_t i = 0; i < 5; i++) {
+    buffers[i] = malloc(48);
+  }
+  for (size_t i = 1; i < 5; i++) {
+    free(buffers[i]);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (size_t i = 0; i < 100000; i++) {
+      free(malloc(4243));
+    }
+    exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+void inline_test(void) {
+  // Runs against the WATCHDOG_INLINE_HEADER build. The header fills the first
+  // 32 bytes of the 48-byte leading canary.
+  WatchdogOptions options = quiet_options();
+  options.canary_size = 48;
+  options.guard_page_threshold = 4096;
+  w_init_with_options(&options);
+  // Damaging the check word leaves the record position intact, so the block
+  // is still found and the underflow reported against it.
+  char* under = malloc(10);
+  under[-40] = 'x';
+  free(under);
+  char* buffer = malloc(10);
+  free(buffer);
+  free(buffer);  // double free
+  // A guarded block is unmapped when it is freed; its header must not be.
+  char* guarded = malloc(8192);
+  free(guarded);
+  free(guarded);
+  printf("inline: done\n");
+}
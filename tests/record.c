@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Recorded by tests/test_runner.py through the preloaded library with
+// WATCHDOG_RECORD. Only this process's own blocks (4242 bytes) may end up in
+// the trace: not the forked child's (4243), nor those of the copy it runs
+// (4244), which must not overwrite the trace either.
+
+static void churn(size_t size, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    void* volatile buffer = malloc(size);
+    free(buffer);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    churn(4244, 10);
+    return EXIT_SUCCESS;
+  }
+  churn(4242, 10);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // More events than the ring holds, so a child still waiting for the
+    // parent's writer thread would never get through them.
+    churn(4243, 100000);
+    exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, NULL, 0);
+  char command[4096];
+  snprintf(command, sizeof command, "%s child", argv[0]);
+  return system(command) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
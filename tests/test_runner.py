@@ -1,19 +1,46 @@
+import os
+import re
+import signal
+import struct
 import subprocess
 import sys
 
+# Seconds before a hung command, and every process it forked, is killed.
+TIMEOUT = 60
 
-def run_tests():
-    print("🚀 Starting Watchdog Tests...")
 
-    # 1. Run the compiled binary
+def run(command, env=None):
     process = subprocess.Popen(
-        ["./test"],
+        command,
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
         text=True,
+        env=env,
+        start_new_session=True,
     )
-    stdout, stderr = process.communicate()
-    combined_output = stdout + stderr
+    try:
+        stdout, stderr = process.communicate(timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        os.killpg(process.pid, signal.SIGKILL)
+        stdout, stderr = process.communicate()
+        stderr += f"\n{command[0]} timed out\n"
+    return stdout + stderr
+
+
+def check(feature, output, pattern, present=True):
+    # A marker is a regular expression; some must not appear at all.
+    if (re.search(pattern, output) is not None) == present:
+        print(f"✅ {feature:25} : {'FOUND' if present else 'ABSENT'}")
+        return True
+    print(f"❌ {feature:25} : {'NOT FOUND' if present else 'FOUND'}")
+    return False
+
+
+def run_tests():
+    print("🚀 Starting Watchdog Tests...")
+
+    # 1. Run the compiled binary
+    combined_output = run(["./test"])
 
     # 2. Define what we EXPECT to see based on your example functions
     expected_markers = {
@@ -27,18 +54,136 @@ def run_tests():
     print("-" * 40)
 
     for feature, marker in expected_markers.items():
-        if marker in combined_output:
-            print(f"✅ {feature:25} : FOUND")
-        else:
-            print(f"❌ {feature:25} : NOT FOUND")
-            passed = False
+        passed &= check(feature, combined_output, re.escape(marker))
+
+    print("-" * 40)
+    return passed
+
+
+# Markers for each scenario of tests/features.c: (feature, pattern, present).
+SCENARIOS = {
+    "index": [
+        ("Index Growth", r"index: 0 live blocks"),
+        ("Index Lookups", r"Total Frees:\s+30000"),
+        ("No Index Errors", r"\[ERROR\]", False),
+    ],
+    "freed": [
+        ("Double Free", r"Double free error\."),
+        ("Realloc After Free", r"Attempt to reallocate a freed pointer\."),
+        ("Freed Block Site", r"\[ALLOCATED\].*\(freed_alloc_site\)"),
+        ("Free Site", r"\[FREED\].*\(freed_free_site\)"),
+    ],
+    "bounds": [
+        ("Overflow Offset", r"Overflow of 0x[0-9a-f]+: .* at end\+2\."),
+        ("Underflow Offset", r"Underflow of 0x[0-9a-f]+: .* at start-3\."),
+    ],
+    "sampling": [
+        ("Sampling Rate", r"Sampling Rate:\s+1 in 4096 Bytes"),
+        ("Sampled Subset", r"sampling: tracked [1-9]\d{0,3} of 20000"),
+        ("Unsampled Frees", r"\[ERROR\]", False),
+    ],
+    "quarantine": [
+        ("Write After Free", r"Write to freed memory\. .* at start\+5 "),
+        ("Write After Realloc", r"Write to freed memory\. .* at start\+1 "),
+    ],
+    "guard": [
+        ("Guard Page Fault", r"Guard page access\. Overflow of 0x[0-9a-f]+"),
+        ("Fault Under Fork", r"guard: child killed by signal 11"),
+    ],
+    "leaks": [
+        ("Leak Groups", r"Leaks by Site: 7 blocks, 2150 Bytes \(2 listed"),
+        ("Leak Group Sizes", r"2000\s+2\s+1000\s+1000\s+\S+ \(leak_site_b\)"),
+        ("Leak Group Range", r"150\s+5\s+10\s+50\s+\S+ \(leak_site_a\)"),
+    ],
+    "cache": [
+        ("Thread Cache Hits", r"Thread Cache:\s+[1-9]\d* hits"),
+        ("Cached Double Free", r"Double free error\."),
+    ],
+    "snapshot": [
+        ("Snapshot Diff", r"Live Blocks:\s+1 -> 4 \(\+3\)"),
+        ("Grown Site", r"\+300\s+\+3\s+300\s+3\s+\S+ \(snapshot_grow\)"),
+    ],
+    "lifetimes": [
+        ("Short-Lived Site", r"1000\s+100%.*\(short_lived_site\)"),
+        ("Moved Block Site", r"100\s+100%.*\(moved_block_site\)"),
+        ("Realloc Moved Block", r"grew in place", False),
+    ],
+}
+
+
+# The inline scenario against the WATCHDOG_INLINE_HEADER build.
+INLINE = [
+    ("Header Underflow", r"Underflow of 0x[0-9a-f]+: .* at start-48\."),
+    ("Inline Double Free", r"Double free error\."),
+    ("Header Found", r"Attempt to free unallocated", False),
+    ("Guarded Double Free", r"(?s)Double free error\..*Double free error\."),
+    ("Guarded Header Mapped", r"inline: done"),
+]
+
+# tests/features.c presets against each WATCHDOG_FEATURES build.
+PRESETS = {
+    "features_counters": r"Live at Exit:\s+1 blocks, 48 Bytes",
+    "features_leaks": r"Leaks by Site: 1 blocks, 48 Bytes",
+    "features_full": r"Leaks by Site: 1 blocks, 48 Bytes",
+}
+
+
+def run_scenarios():
+    print("🚀 Starting Watchdog Feature Tests...")
+    passed = True
+    print("-" * 40)
+
+    for scenario, markers in SCENARIOS.items():
+        output = run(["./features", scenario])
+        for feature, pattern, *present in markers:
+            passed &= check(feature, output, pattern, *present)
+
+    output = run(["./features_inline", "inline"])
+    for feature, pattern, *present in INLINE:
+        passed &= check(feature, output, pattern, *present)
+
+    for binary, pattern in PRESETS.items():
+        output = run([f"./{binary}", "presets"])
+        passed &= check(binary, output, pattern)
+        passed &= check(f"{binary} errors", output, r"Attempt to free")
+
+    # Binary trace through the asynchronous logger, decoded by wdtrace.
+    output = run(["./features", "trace"])
+    output = run(["./wdtrace", "-r", "features.trace"])
+    passed &= check("Trace Allocations", output, r"Total Allocations:\s+5\n")
+    passed &= check("Trace Frees", output, r"Total Frees:\s+4\n")
+    passed &= check("Trace Leaks", output, r"Leaks:\s+1 \(48 Bytes\)")
+    output = run(["./wdtrace", "features.trace"])
+    passed &= check("Trace Sites", output, r"\[MALLOC\].*\(trace_test\)")
+    passed &= check("Forked Child Untraced", output, r"= 4243 Bytes", False)
+
+    # A site id or string offset out of range is rejected, not followed.
+    with open("features.trace", "rb") as file:
+        trace = bytearray(file.read())
+    sites_offset = struct.unpack_from("<Q", trace, 32)[0]
+    for field, offset in (("Site Id", 0), ("Site String", 12)):
+        corrupt = bytearray(trace)
+        struct.pack_into("<I", corrupt, sites_offset + offset, 0xFFFFFFFF)
+        with open("corrupt.trace", "wb") as file:
+            file.write(corrupt)
+        output = run(["./wdtrace", "corrupt.trace"])
+        passed &= check(f"Corrupt {field}", output, r"corrupt trace")
+
+    # A recording through the preloaded library, with a forked child and an
+    # executed copy that must stay out of it.
+    env = dict(os.environ, LD_PRELOAD="./libwatchdog.so")
+    env["WATCHDOG_RECORD"] = "record.trace"
+    run(["./record"], env)
+    output = run(["./wdtrace", "record.trace"])
+    passed &= check("Recorded Blocks", output, r"\[MALLOC\].* = 4242 Bytes")
+    passed &= check("Children Unrecorded", output, r"= 424[34] Bytes", False)
 
     print("-" * 40)
     return passed
 
 
 if __name__ == "__main__":
-    if run_tests():
+    if run_tests() & run_scenarios():
         print("🎉 ALL TESTS PASSED")
         sys.exit(0)
     else:
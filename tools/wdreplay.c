@@ -0,0 +1,659 @@
+// wdreplay: replays the allocations of a binary trace against the system
+// allocator and against watchdog, to benchmark watchdog on a real program's
+// allocation pattern without the program.
+//
+// Usage: wdreplay [-m MODE] [-p] watchdog.trace
+//
+//   -m MODE  replay only this mode (see `modes` below)
+//   -p       keep the recorded pace: each operation waits until its
+//            recorded offset from the first event
+//
+// Record the trace with verbose binary logging and nothing dropped, e.g.
+// `WATCHDOG_RECORD=app.trace LD_PRELOAD=./libwatchdog.so ./app`, or with
+// `log_format = WATCHDOG_FORMAT_BINARY`, `enable_verbose_log = true` and
+// either synchronous logging or `ring_full_policy = WATCHDOG_RING_BLOCK`.
+// Sampling must be off, since skipped allocations are not traced. Only the
+// recording process is traced: forked children stay out of its trace, and
+// WATCHDOG_RECORD is removed from the environment of programs it executes
+// unless the path contains %p, which becomes the process ID.
+//
+// Every recorded thread gets a replay thread that runs its operations in
+// order. A free or realloc of a block allocated on another thread waits until
+// that allocation has been replayed, so blocks are handed between threads as
+// in the recording. Each mode runs in a forked child, like bench/suite.c, and
+// prints one CSV row with throughput, sampled per-operation latency and peak
+// RSS.
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../watchdog.h"
+#include "../watchdog_trace.h"
+
+#define LATENCY_SAMPLE_EVERY 16
+#define NO_SLOT UINT32_MAX
+// Replayed blocks get one write per page, as a program would touch them.
+#define TOUCH_STRIDE 4096
+
+// One replayed operation. Blocks are numbered by the operation that
+// allocated them: `in` is the block a free or realloc consumes, `out` the
+// block a malloc, calloc or realloc produces.
+typedef struct {
+  uint32_t op;  // WatchdogEventType
+  uint32_t site;
+  uint32_t in;
+  uint32_t out;
+  uint64_t size;
+  uint64_t time;  // nanoseconds after the first event
+} Op;
+
+typedef struct {
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} Samples;
+
+// The operations of one recorded thread.
+typedef struct {
+  uint32_t thread;
+  Op* ops;
+  size_t count;
+  size_t capacity;
+  Samples samples;
+} Lane;
+
+// Live addresses of the trace, each mapped to the oldest block living there.
+// With asynchronous logging, a block's FREE may be logged after the MALLOC
+// that reused its address, so newer blocks at the same address are chained
+// behind it through `newer`.
+typedef struct {
+  uint64_t* keys;  // 0: empty, 1: deleted
+  uint32_t* slots;
+  size_t capacity;
+  size_t used;  // live and deleted entries
+} AddressMap;
+
+typedef struct {
+  Lane* lanes;
+  size_t lane_count;
+  size_t op_count;
+  size_t skipped;  // frees and reallocs of blocks allocated before the trace
+  uint32_t block_count;
+  uint64_t* addresses;  // recorded address of each block
+  uint32_t* newer;
+  const WatchdogTraceSite** sites;  // indexed by call-site id
+  uint32_t site_limit;
+  const char* strings;
+} Replay;
+
+typedef struct {
+  const char* name;
+  bool watchdog;
+  size_t thread_cache_bytes;
+} Mode;
+
+// Sent from the child that ran a mode to the parent.
+typedef struct {
+  size_t ops;
+  double seconds;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} Result;
+
+static const Mode modes[] = {
+    {"system", false, 0},
+    {"quiet", true, 0},
+    {"cached", true, 1 << 20},
+};
+
+#define COUNT(array) (sizeof(array) / sizeof *(array))
+
+static Replay replay;
+static bool use_watchdog = false;
+static bool keep_pace = false;
+static uint64_t replay_start = 0;
+// Replayed blocks and whether each has been produced yet.
+static void** blocks = NULL;
+static atomic_bool* produced = NULL;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void* checked_realloc(void* ptr, size_t size) {
+  void* moved = realloc(ptr, size);
+  if (!moved) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return moved;
+}
+
+static void samples_add(Samples* samples, uint64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 4096;
+    samples->values = checked_realloc(
+        samples->values, samples->capacity * sizeof *samples->values);
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const Samples* samples, double quantile) {
+  if (!samples->count) {
+    return 0;
+  }
+  size_t rank = (size_t)(quantile * (double)(samples->count - 1) + 0.5);
+  return samples->values[rank];
+}
+
+//------------------------------------------------------------------------------
+// Loading
+//------------------------------------------------------------------------------
+
+static size_t address_hash(uint64_t address, size_t capacity) {
+  return (size_t)((address >> 4) * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+}
+
+static void address_map_grow(AddressMap* map) {
+  AddressMap grown = {.capacity = map->capacity ? map->capacity * 2 : 4096};
+  grown.keys = calloc(grown.capacity, sizeof *grown.keys);
+  grown.slots = calloc(grown.capacity, sizeof *grown.slots);
+  if (!grown.keys || !grown.slots) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->keys[i] > 1) {
+      size_t j = address_hash(map->keys[i], grown.capacity);
+      while (grown.keys[j]) {
+        j = (j + 1) & (grown.capacity - 1);
+      }
+      grown.keys[j] = map->keys[i];
+      grown.slots[j] = map->slots[i];
+      grown.used++;
+    }
+  }
+  free(map->keys);
+  free(map->slots);
+  *map = grown;
+}
+
+// Returns the entry of `address`, or the empty one where it would go.
+static size_t address_map_find(const AddressMap* map, uint64_t address) {
+  size_t i = address_hash(address, map->capacity);
+  while (map->keys[i] && map->keys[i] != address) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  return i;
+}
+
+static uint32_t block_new(uint64_t address, AddressMap* map) {
+  if ((map->used + 1) * 2 > map->capacity) {
+    address_map_grow(map);
+  }
+  if (!(replay.block_count & (replay.block_count + 1))) {
+    size_t capacity = ((size_t)replay.block_count + 1) * 2;
+    replay.addresses = checked_realloc(
+        replay.addresses, capacity * sizeof *replay.addresses);
+    replay.newer =
+        checked_realloc(replay.newer, capacity * sizeof *replay.newer);
+  }
+  uint32_t block = replay.block_count++;
+  replay.addresses[block] = address;
+  replay.newer[block] = NO_SLOT;
+  size_t i = address_map_find(map, address);
+  if (!map->keys[i]) {
+    map->keys[i] = address;
+    map->slots[i] = block;
+    map->used++;
+    return block;
+  }
+  uint32_t last = map->slots[i];
+  while (replay.newer[last] != NO_SLOT) {
+    last = replay.newer[last];
+  }
+  replay.newer[last] = block;
+  return block;
+}
+
+// Takes the oldest live block at `address`, or NO_SLOT.
+static uint32_t block_take(uint64_t address, AddressMap* map) {
+  if (!map->capacity) {
+    return NO_SLOT;
+  }
+  size_t i = address_map_find(map, address);
+  if (!map->keys[i]) {
+    return NO_SLOT;
+  }
+  uint32_t block = map->slots[i];
+  if (replay.newer[block] != NO_SLOT) {
+    map->slots[i] = replay.newer[block];
+  } else {
+    map->keys[i] = 1;
+  }
+  return block;
+}
+
+static Lane* lane_for(uint32_t thread) {
+  for (size_t i = 0; i < replay.lane_count; i++) {
+    if (replay.lanes[i].thread == thread) {
+      return &replay.lanes[i];
+    }
+  }
+  replay.lanes = checked_realloc(
+      replay.lanes, (replay.lane_count + 1) * sizeof *replay.lanes);
+  Lane* lane = &replay.lanes[replay.lane_count++];
+  memset(lane, 0, sizeof *lane);
+  lane->thread = thread;
+  return lane;
+}
+
+static Op* lane_push(Lane* lane) {
+  if (lane->count == lane->capacity) {
+    lane->capacity = lane->capacity ? lane->capacity * 2 : 1024;
+    lane->ops = checked_realloc(lane->ops, lane->capacity * sizeof *lane->ops);
+  }
+  replay.op_count++;
+  return &lane->ops[lane->count++];
+}
+
+// Turns the trace's events into per-thread operations. Watchdog logs a
+// realloc as a FREE of the old block followed by a REALLOC, so the pair is
+// merged back into one operation.
+static void replay_load(const WatchdogTraceRecord* records, uint64_t count) {
+  AddressMap map = {0};
+  uint64_t first = count ? records[0].timestamp : 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const WatchdogTraceRecord* record = &records[i];
+    if (record->op > WATCHDOG_EVENT_FREE) {
+      continue;
+    }
+    Lane* lane = lane_for(record->thread);
+    uint64_t time = record->timestamp > first ? record->timestamp - first : 0;
+    if (record->op == WATCHDOG_EVENT_REALLOC && lane->count) {
+      Op* last = &lane->ops[lane->count - 1];
+      if (last->op == WATCHDOG_EVENT_FREE &&
+          replay.addresses[last->in] == record->aux) {
+        last->op = WATCHDOG_EVENT_REALLOC;
+        last->site = record->site;
+        last->out = block_new(record->ptr, &map);
+        last->size = record->size;
+        continue;
+      }
+    }
+    uint32_t in = NO_SLOT;
+    if (record->op == WATCHDOG_EVENT_FREE ||
+        record->op == WATCHDOG_EVENT_REALLOC) {
+      uint64_t address =
+          record->op == WATCHDOG_EVENT_FREE ? record->ptr : record->aux;
+      in = block_take(address, &map);
+      if (in == NO_SLOT && record->op == WATCHDOG_EVENT_FREE) {
+        replay.skipped++;
+        continue;
+      }
+    }
+    Op* op = lane_push(lane);
+    *op = (Op){
+        .op = record->op,
+        .site = record->site,
+        .in = in,
+        .out = record->op == WATCHDOG_EVENT_FREE
+                   ? NO_SLOT
+                   : block_new(record->ptr, &map),
+        .size = record->size,
+        .time = time,
+    };
+    if (record->op == WATCHDOG_EVENT_REALLOC && in == NO_SLOT) {
+      // Resizes a block from before the trace; replayed as an allocation.
+      replay.skipped++;
+    }
+  }
+  free(map.keys);
+  free(map.slots);
+}
+
+// Maps the trace and loads its operations. Like wdtrace, recovers the
+// records of a trace that was never closed.
+static bool trace_load(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < WATCHDOG_TRACE_RECORDS_OFFSET) {
+    fprintf(stderr, "%s: not a watchdog trace\n", path);
+    close(fd);
+    return false;
+  }
+  size_t length = (size_t)st.st_size;
+  const unsigned char* base =
+      mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  const WatchdogTraceHeader* header = (const WatchdogTraceHeader*)base;
+  const WatchdogTraceRecord* records =
+      (const WatchdogTraceRecord*)(base + WATCHDOG_TRACE_RECORDS_OFFSET);
+  uint64_t count =
+      (length - WATCHDOG_TRACE_RECORDS_OFFSET) / sizeof(WatchdogTraceRecord);
+  if (memcmp(header->magic, WATCHDOG_TRACE_MAGIC,
+             sizeof WATCHDOG_TRACE_MAGIC) == 0) {
+    if (header->version != WATCHDOG_TRACE_VERSION ||
+        header->record_size != sizeof(WatchdogTraceRecord) ||
+        !watchdog_trace_valid(base, length)) {
+      fprintf(stderr, "%s: unsupported or corrupt trace\n", path);
+      munmap((void*)base, length);
+      return false;
+    }
+    records = (const WatchdogTraceRecord*)(base + header->records_offset);
+    count = header->record_count;
+    const WatchdogTraceSite* sites =
+        (const WatchdogTraceSite*)(base + header->sites_offset);
+    for (uint32_t i = 0; i < header->site_count; i++) {
+      if (sites[i].id >= replay.site_limit) {
+        replay.site_limit = sites[i].id + 1;
+      }
+    }
+    replay.sites = calloc(replay.site_limit ? replay.site_limit : 1,
+                          sizeof *replay.sites);
+    if (!replay.sites) {
+      perror("calloc");
+      munmap((void*)base, length);
+      return false;
+    }
+    for (uint32_t i = 0; i < header->site_count; i++) {
+      replay.sites[sites[i].id] = &sites[i];
+    }
+    replay.strings = (const char*)base + header->strings_offset;
+  } else {
+    fprintf(stderr, "%s: trace was not closed; call sites are unavailable\n",
+            path);
+  }
+  replay_load(records, count);
+  // The site strings stay mapped; watchdog keeps pointers to them.
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Replay
+//------------------------------------------------------------------------------
+
+// Recorded call sites become watchdog call sites, so per-site work matches
+// the recording; unnamed ones share a file and keep their id as the line.
+static void op_site(uint32_t id, const char** file, int* line,
+                    const char** func) {
+  const WatchdogTraceSite* site =
+      id < replay.site_limit ? replay.sites[id] : NULL;
+  if (!site) {
+    *file = "replay";
+    *line = (int)id;
+    *func = "??";
+    return;
+  }
+  *file = replay.strings + site->file_offset;
+  *line = (int)site->line;
+  *func = replay.strings + site->func_offset;
+}
+
+static void* op_run(const Op* op, void* in) {
+  if (!use_watchdog) {
+    switch (op->op) {
+      case WATCHDOG_EVENT_MALLOC:
+        return malloc(op->size);
+      case WATCHDOG_EVENT_CALLOC:
+        return calloc(1, op->size);
+      case WATCHDOG_EVENT_REALLOC:
+        return realloc(in, op->size);
+      default:
+        free(in);
+        return NULL;
+    }
+  }
+  const char* file;
+  int line;
+  const char* func;
+  op_site(op->site, &file, &line, &func);
+  switch (op->op) {
+    case WATCHDOG_EVENT_MALLOC:
+      return w_malloc(op->size, file, line, func);
+    case WATCHDOG_EVENT_CALLOC:
+      return w_calloc(1, op->size, file, line, func);
+    case WATCHDOG_EVENT_REALLOC:
+      return w_realloc(in, op->size, file, line, func);
+    default:
+      w_free(in, file, line, func);
+      return NULL;
+  }
+}
+
+static void* lane_run(void* arg) {
+  Lane* lane = arg;
+  for (size_t i = 0; i < lane->count; i++) {
+    const Op* op = &lane->ops[i];
+    if (keep_pace) {
+      uint64_t due = replay_start + op->time;
+      uint64_t now = now_ns();
+      if (now < due) {
+        struct timespec pause = {.tv_sec = (time_t)((due - now) / 1000000000),
+                                 .tv_nsec = (long)((due - now) % 1000000000)};
+        nanosleep(&pause, NULL);
+      }
+    }
+    void* in = NULL;
+    if (op->in != NO_SLOT) {
+      while (!atomic_load_explicit(&produced[op->in], memory_order_acquire)) {
+        sched_yield();
+      }
+      in = blocks[op->in];
+      blocks[op->in] = NULL;
+    }
+    void* out;
+    if (i % LATENCY_SAMPLE_EVERY == 0) {
+      uint64_t start = now_ns();
+      out = op_run(op, in);
+      samples_add(&lane->samples, now_ns() - start);
+    } else {
+      out = op_run(op, in);
+    }
+    if (op->out != NO_SLOT) {
+      if (out && op->op != WATCHDOG_EVENT_CALLOC) {
+        for (uint64_t offset = 0; offset < op->size; offset += TOUCH_STRIDE) {
+          ((volatile unsigned char*)out)[offset] = 0xA5;
+        }
+      }
+      blocks[op->out] = out;
+      atomic_store_explicit(&produced[op->out], true, memory_order_release);
+    }
+  }
+  return NULL;
+}
+
+static Result run(const Mode* mode) {
+  if (mode->watchdog) {
+    WatchdogOptions options = w_default_options();
+    options.enable_verbose_log = false;
+    options.log_to_file = true;
+    options.thread_cache_bytes = mode->thread_cache_bytes;
+    w_init_with_options(&options);
+    use_watchdog = true;
+  }
+  blocks = calloc(replay.block_count ? replay.block_count : 1,
+                  sizeof *blocks);
+  produced = calloc(replay.block_count ? replay.block_count : 1,
+                    sizeof *produced);
+  pthread_t* ids = calloc(replay.lane_count ? replay.lane_count : 1,
+                          sizeof *ids);
+  if (!blocks || !produced || !ids) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  replay_start = now_ns();
+  size_t started = 0;
+  for (; started < replay.lane_count; started++) {
+    if (pthread_create(&ids[started], NULL, lane_run,
+                       &replay.lanes[started]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t t = 0; t < started; t++) {
+    pthread_join(ids[t], NULL);
+  }
+  free(ids);
+  Result result = {.seconds = (now_ns() - replay_start) * 1e-9,
+                   .ops = replay.op_count};
+
+  Samples all = {0};
+  for (size_t t = 0; t < replay.lane_count; t++) {
+    Samples* samples = &replay.lanes[t].samples;
+    for (size_t i = 0; i < samples->count; i++) {
+      samples_add(&all, samples->values[i]);
+    }
+  }
+  qsort(all.values, all.count, sizeof *all.values, compare_u64);
+  result.p50 = percentile(&all, 0.5);
+  result.p90 = percentile(&all, 0.9);
+  result.p99 = percentile(&all, 0.99);
+  result.p999 = percentile(&all, 0.999);
+  result.max = all.count ? all.values[all.count - 1] : 0;
+  free(all.values);
+
+  // Blocks the recorded program never freed are released untimed, so they
+  // are not reported as leaks. Consumed blocks were cleared by their
+  // consumer.
+  for (size_t t = 0; t < replay.lane_count; t++) {
+    const Lane* lane = &replay.lanes[t];
+    for (size_t i = 0; i < lane->count; i++) {
+      if (lane->ops[i].out != NO_SLOT && blocks[lane->ops[i].out]) {
+        Op release = {.op = WATCHDOG_EVENT_FREE, .site = lane->ops[i].site};
+        op_run(&release, blocks[lane->ops[i].out]);
+        blocks[lane->ops[i].out] = NULL;
+      }
+    }
+  }
+  free(blocks);
+  free(produced);
+  return result;
+}
+
+static bool run_isolated(const Mode* mode, Result* result,
+                         long* max_rss_kb) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    perror("pipe");
+    return false;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    Result child = run(mode);
+    ssize_t written = write(pipe_fds[1], &child, sizeof child);
+    close(pipe_fds[1]);
+    exit(written == (ssize_t)sizeof child ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  close(pipe_fds[1]);
+  ssize_t received = read(pipe_fds[0], result, sizeof *result);
+  close(pipe_fds[0]);
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  *max_rss_kb = usage.ru_maxrss;
+  unlink("watchdog.log");
+  return received == (ssize_t)sizeof *result && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [-m MODE] [-p] TRACE\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  const char* only_mode = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p")) != -1) {
+    switch (opt) {
+      case 'm':
+        only_mode = optarg;
+        break;
+      case 'p':
+        keep_pace = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  if (!trace_load(argv[optind])) {
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "%s: %zu operations on %zu threads, %zu skipped\n",
+          argv[optind], replay.op_count, replay.lane_count, replay.skipped);
+
+  printf("mode,threads,ops,seconds,ops_per_sec,p50_ns,p90_ns,p99_ns,"
+         "p999_ns,max_ns,max_rss_kb,rss_vs_system\n");
+  long system_rss_kb = 0;
+  for (size_t m = 0; m < COUNT(modes); m++) {
+    const Mode* mode = &modes[m];
+    if (only_mode && strcmp(only_mode, mode->name) != 0) {
+      continue;
+    }
+    Result result;
+    long max_rss_kb;
+    if (!run_isolated(mode, &result, &max_rss_kb)) {
+      fprintf(stderr, "%s: replay failed\n", mode->name);
+      continue;
+    }
+    if (!mode->watchdog) {
+      system_rss_kb = max_rss_kb;
+    }
+    printf("%s,%zu,%zu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%ld,", mode->name,
+           replay.lane_count, result.ops, result.seconds,
+           result.ops / result.seconds, (unsigned long long)result.p50,
+           (unsigned long long)result.p90, (unsigned long long)result.p99,
+           (unsigned long long)result.p999, (unsigned long long)result.max,
+           max_rss_kb);
+    if (system_rss_kb) {
+      printf("%.2f\n", (double)max_rss_kb / system_rss_kb);
+    } else {
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+// wdtrace: decodes a binary trace written with WATCHDOG_FORMAT_BINARY.
+//
+// Usage: wdtrace [-r] [-s SITE] [-f SECONDS] [-t SECONDS] watchdog.trace
+//
+//   -r          print the end-of-run report instead of the events
+//   -s SITE     only events from SITE, given as a call-site id or FILE:LINE
+//   -f SECONDS  skip events earlier than SECONDS after the first event
+//   -t SECONDS  skip events later than SECONDS after the first event
+//
+// The trace is memory-mapped and read in place; nothing is copied.
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../watchdog_trace.h"
+
+typedef struct {
+  const unsigned char* base;
+  size_t length;
+  const WatchdogTraceHeader* header;
+  const WatchdogTraceRecord* records;
+  uint64_t record_count;
+  const WatchdogTraceSite** sites;  // indexed by call-site id
+  uint32_t site_limit;
+  const char* strings;
+  int64_t realtime_offset;
+} Trace;
+
+typedef struct {
+  bool report;
+  bool has_site_id;
+  uint32_t site_id;
+  const char* site_file;  // FILE part of a FILE:LINE filter
+  unsigned int site_line;
+  double from;
+  double to;
+} Filter;
+
+static void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [-r] [-s SITE] [-f SECONDS] [-t SECONDS] TRACE\n"
+          "  -r          print the end-of-run report instead of the events\n"
+          "  -s SITE     only events from SITE (call-site id or FILE:LINE)\n"
+          "  -f SECONDS  skip events earlier than SECONDS into the trace\n"
+          "  -t SECONDS  skip events later than SECONDS into the trace\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+static bool trace_open(const char* path, Trace* trace) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < WATCHDOG_TRACE_RECORDS_OFFSET) {
+    fprintf(stderr, "%s: not a watchdog trace\n", path);
+    close(fd);
+    return false;
+  }
+  memset(trace, 0, sizeof *trace);
+  trace->length = (size_t)st.st_size;
+  trace->base = mmap(NULL, trace->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (trace->base == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  trace->header = (const WatchdogTraceHeader*)trace->base;
+  const WatchdogTraceHeader* header = trace->header;
+  if (memcmp(header->magic, WATCHDOG_TRACE_MAGIC,
+             sizeof WATCHDOG_TRACE_MAGIC) == 0) {
+    if (header->version != WATCHDOG_TRACE_VERSION ||
+        header->record_size != sizeof(WatchdogTraceRecord)) {
+      fprintf(stderr, "%s: unsupported trace version %u\n", path,
+              header->version);
+      munmap((void*)trace->base, trace->length);
+      return false;
+    }
+    if (!watchdog_trace_valid(trace->base, trace->length)) {
+      fprintf(stderr, "%s: truncated or corrupt trace\n", path);
+      munmap((void*)trace->base, trace->length);
+      return false;
+    }
+    trace->records =
+        (const WatchdogTraceRecord*)(trace->base + header->records_offset);
+    trace->record_count = header->record_count;
+    trace->realtime_offset = header->realtime_offset;
+    trace->strings = (const char*)trace->base + header->strings_offset;
+    const WatchdogTraceSite* sites =
+        (const WatchdogTraceSite*)(trace->base + header->sites_offset);
+    for (uint32_t i = 0; i < header->site_count; i++) {
+      if (sites[i].id >= trace->site_limit) {
+        trace->site_limit = sites[i].id + 1;
+      }
+    }
+    trace->sites = calloc(trace->site_limit ? trace->site_limit : 1,
+                          sizeof *trace->sites);
+    if (!trace->sites) {
+      perror("calloc");
+      munmap((void*)trace->base, trace->length);
+      return false;
+    }
+    for (uint32_t i = 0; i < header->site_count; i++) {
+      trace->sites[sites[i].id] = &sites[i];
+    }
+  } else {
+    // The process died before closing the trace: the header is still the
+    // zeroed placeholder and there is no call-site table. Recover the records
+    // that made it to disk and print the current time zone's wall clock.
+    fprintf(stderr, "%s: trace was not closed; call sites are unavailable\n",
+            path);
+    size_t offset = WATCHDOG_TRACE_RECORDS_OFFSET;
+    trace->records = (const WatchdogTraceRecord*)(trace->base + offset);
+    trace->record_count =
+        (trace->length - offset) / sizeof(WatchdogTraceRecord);
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    trace->realtime_offset = (real.tv_sec - mono.tv_sec) * 1000000000LL +
+                             (real.tv_nsec - mono.tv_nsec);
+  }
+  return true;
+}
+
+static void trace_site(const Trace* trace, uint32_t id, const char** file,
+                       unsigned int* line, const char** func) {
+  const WatchdogTraceSite* site =
+      id < trace->site_limit ? trace->sites[id] : NULL;
+  if (!site) {
+    *file = "??";
+    *line = 0;
+    *func = "??";
+    return;
+  }
+  *file = trace->strings + site->file_offset;
+  *line = site->line;
+  *func = trace->strings + site->func_offset;
+}
+
+static bool filter_match(const Trace* trace, const Filter* filter,
+                         const WatchdogTraceRecord* record, uint64_t start) {
+  // Async traces are only roughly ordered, so this may be slightly negative.
+  double seconds = (int64_t)(record->timestamp - start) * 1e-9;
+  if (seconds < filter->from || seconds > filter->to) {
+    return false;
+  }
+  if (filter->has_site_id) {
+    return record->site == filter->site_id;
+  }
+  if (filter->site_file) {
+    const char* file;
+    unsigned int line;
+    const char* func;
+    trace_site(trace, record->site, &file, &line, &func);
+    return line == filter->site_line && strcmp(file, filter->site_file) == 0;
+  }
+  return true;
+}
+
+static void print_event(const Trace* trace, const WatchdogTraceRecord* record) {
+  const char* file;
+  unsigned int line;
+  const char* func;
+  trace_site(trace, record->site, &file, &line, &func);
+
+  char time_str[26];
+  time_t now = (time_t)(((int64_t)record->timestamp + trace->realtime_offset) /
+                        1000000000LL);
+  ctime_r(&now, time_str);
+  time_str[strlen(time_str) - 1] = '\0';
+
+  if (record->op == WATCHDOG_EVENT_ERROR) {
+    char message[WATCHDOG_ERROR_TEXT_SIZE];
+    watchdog_error_text(record, message, sizeof message);
+    printf("[ERROR] %s [%s:%u (%s)]: %s\n", time_str, file, line, func,
+           message);
+  } else {
+    printf("[%s] %s [%s:%u (%s)]: %p = %zu Bytes\n",
+           watchdog_event_name(record->op), time_str, file, line, func,
+           (void*)(uintptr_t)record->ptr, (size_t)record->size);
+  }
+}
+
+static void print_report(const Trace* trace, const Filter* filter,
+                         uint64_t start) {
+  size_t allocations = 0;
+  size_t frees = 0;
+  size_t leaks = 0;
+  size_t leaked_bytes = 0;
+  size_t usage = 0;
+  size_t peak = 0;
+  size_t errors[WATCHDOG_ERROR_COUNT] = {0};
+  uint64_t first = 0;
+  uint64_t last = 0;
+  size_t events = 0;
+
+  for (uint64_t i = 0; i < trace->record_count; i++) {
+    const WatchdogTraceRecord* record = &trace->records[i];
+    if (!filter_match(trace, filter, record, start)) {
+      continue;
+    }
+    if (!events++) {
+      first = record->timestamp;
+    }
+    last = record->timestamp;
+    switch (record->op) {
+      case WATCHDOG_EVENT_MALLOC:
+      case WATCHDOG_EVENT_CALLOC:
+      case WATCHDOG_EVENT_REALLOC:
+        allocations++;
+        usage += record->size;
+        if (usage > peak) {
+          peak = usage;
+        }
+        break;
+      case WATCHDOG_EVENT_FREE:
+        frees++;
+        usage -= record->size < usage ? record->size : usage;
+        break;
+      case WATCHDOG_EVENT_LEAK:
+        // Still live at exit; not a free.
+        leaks++;
+        leaked_bytes += record->size;
+        break;
+      case WATCHDOG_EVENT_ERROR:
+        if (record->size < WATCHDOG_ERROR_COUNT) {
+          errors[record->size]++;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  printf("\n---Watchdog Report---\n");
+  printf("Events:             %zu\n", events);
+  printf("Duration:           %.6f seconds\n",
+         events ? (int64_t)(last - first) * 1e-9 : 0.0);
+  printf("Total Allocations:  %zu\n", allocations);
+  printf("Total Frees:        %zu\n", frees);
+  printf("Peak Memory Usage:  %zu Bytes (%.2f MB)\n", peak,
+         peak / 1024.0 / 1024.0);
+  printf("Leaks:              %zu (%zu Bytes)\n", leaks, leaked_bytes);
+  for (size_t e = 0; e < WATCHDOG_ERROR_COUNT; e++) {
+    if (errors[e]) {
+      printf("Errors:             %zu x %s\n", errors[e],
+             watchdog_error_message(e));
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  Filter filter = {.from = 0, .to = 1e300};
+  int opt;
+  while ((opt = getopt(argc, argv, "rs:f:t:")) != -1) {
+    switch (opt) {
+      case 'r':
+        filter.report = true;
+        break;
+      case 's': {
+        char* colon = strrchr(optarg, ':');
+        if (colon) {
+          *colon = '\0';
+          filter.site_file = optarg;
+          filter.site_line = (unsigned int)strtoul(colon + 1, NULL, 10);
+        } else {
+          filter.has_site_id = true;
+          filter.site_id = (uint32_t)strtoul(optarg, NULL, 10);
+        }
+        break;
+      }
+      case 'f':
+        filter.from = strtod(optarg, NULL);
+        break;
+      case 't':
+        filter.to = strtod(optarg, NULL);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  Trace trace;
+  if (!trace_open(argv[optind], &trace)) {
+    return EXIT_FAILURE;
+  }
+  uint64_t start = trace.record_count ? trace.records[0].timestamp : 0;
+
+  if (filter.report) {
+    print_report(&trace, &filter, start);
+  } else {
+    for (uint64_t i = 0; i < trace.record_count; i++) {
+      if (filter_match(&trace, &filter, &trace.records[i], start)) {
+        print_event(&trace, &trace.records[i]);
+      }
+    }
+  }
+
+  free(trace.sites);
+  munmap((void*)trace.base, trace.length);
+  return EXIT_SUCCESS;
+}
@@ -1,21 +1,116 @@
 #define WATCHDOG_INTERNAL
+// For RTLD_NEXT in the preload build and SCHED_IDLE for background threads.
+#define _GNU_SOURCE
 #include "watchdog.h"
+#include "watchdog_trace.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if WATCHDOG_PRELOAD && WATCHDOG_INLINE_HEADER
+// Headers would be read in front of every foreign block passed to free.
+#error "WATCHDOG_INLINE_HEADER cannot be combined with WATCHDOG_PRELOAD"
+#endif
+
+// True when a WATCHDOG_FEATURE_* bit is compiled in. Code behind a false
+// constant condition is removed by the compiler, but still type-checked.
+#define W_HAS(feature) ((WATCHDOG_FEATURES & WATCHDOG_FEATURE_##feature) != 0)
+
+#if WATCHDOG_MAX_CALL_SITES > WATCHDOG_TRACE_MAX_SITES
+// Trace readers reject larger call-site ids.
+#error "WATCHDOG_MAX_CALL_SITES exceeds WATCHDOG_TRACE_MAX_SITES"
+#endif
+
+#if W_HAS(CANARIES) && !W_HAS(TRACKING)
+// Guards are checked against the sizes kept in the records.
+#error "WATCHDOG_FEATURE_CANARIES requires WATCHDOG_FEATURE_TRACKING"
+#endif
+
+#if WATCHDOG_PRELOAD
+#include <dlfcn.h>
+#include <malloc.h>
+// Thread-locals may be touched inside malloc, so they must not be allocated
+// lazily by the dynamic loader.
+#define WATCHDOG_TLS _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define WATCHDOG_TLS _Thread_local
+#endif
+
+#if WATCHDOG_PRELOAD
+// The interposers pass their caller's return address as `func`.
+#define W_STACK_ANCHOR(func) ((const void*)(func))
+#else
+#define W_STACK_ANCHOR(func) __builtin_return_address(0)
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 static const char* log_file_name = "watchdog.log";
+// Guards initialization and the log configuration only. Allocation tracking
+// is protected by the per-shard locks below.
 static pthread_mutex_t w_mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE* w_log_file = NULL;
 static bool verbose_log = true;
 static bool log_to_file = false;
 static bool color_output = false;
-static bool w_initialized = false;
+static WatchdogLogFormat log_format = WATCHDOG_FORMAT_TEXT;
+// Guard bytes on each side of a block. Fixed at the first initialization.
+static size_t canary_size = WATCHDOG_DEFAULT_CANARY_SIZE;
+// Mean bytes between fully tracked allocations, 0 to track everything. Fixed
+// at the first initialization.
+static size_t sample_rate = 0;
+// Length of each per-site list in the exit report.
+static size_t report_top_sites = 10;
+// Return addresses captured per tracked allocation, 0 for none.
+static size_t stack_depth = 0;
+// Leaked blocks logged one by one before the per-site leak summary.
+static size_t report_leak_details = 100;
+// Per-site lifetime histograms, and what counts as short-lived.
+static bool lifetime_profile = false;
+static size_t short_lived_ns = 10000;
+static size_t short_lived_allocations = 100;
+// Freed-block quarantine. The poison byte is fixed at the first
+// initialization, since quarantined blocks are checked against it.
+static size_t quarantine_bytes = 0;
+static unsigned char quarantine_poison = 0;
+static bool quarantine_verify = true;
+// Live blocks the canary scrubber checks per tick.
+static size_t scrub_blocks_per_tick = 0;
+// Smallest block served from its own mapping with a guard page behind it, 0
+// for none. Fixed at the first initialization, like the page size.
+static size_t guard_page_threshold = 0;
+static size_t w_page_size = 4096;
+// Bytes of released blocks each thread may keep for reuse, 0 for none. Fixed
+// at the first initialization, since blocks are sized for their cache class
+// while it is on.
+static size_t thread_cache_bytes = 0;
+static atomic_bool w_initialized = false;
 static bool w_atexit_registered = false;
 
 typedef unsigned char BYTE;
 
-#define WATCHDOG_LOG(prefix, ptr, size, file, line, func)                      \
+// Both log macros format a single line stamped with `when` and leave flushing
+// to the caller, so the background writer can flush once per batch.
+#define WATCHDOG_LOG(when, prefix, ptr, size, file, line, func)                \
   do {                                                                         \
-    time_t now = time(NULL);                                                   \
-    char* time_str = ctime(&now);                                              \
+    char time_str[26];                                                         \
+    time_t now = (when);                                                       \
+    ctime_r(&now, time_str);                                                   \
     time_str[strlen(time_str) - 1] = '\0';                                     \
     if (color_output && w_log_file == stdout) {                                \
       fprintf(w_log_file,                                                      \
@@ -27,13 +122,13 @@ typedef unsigned char BYTE;
       fprintf(w_log_file, "[%s] %s [%s:%d (%s)]: %p = %zu Bytes\n", prefix,    \
               time_str, file, line, func, ptr, size);                          \
     }                                                                          \
-    fflush(w_log_file);                                                        \
   } while (0)
 
-#define WATCHDOG_LOG_ERROR(msg, file, line, func)                          \
+#define WATCHDOG_LOG_ERROR(when, msg, file, line, func)                    \
   do {                                                                     \
-    time_t now = time(NULL);                                               \
-    char* time_str = ctime(&now);                                          \
+    char time_str[26];                                                     \
+    time_t now = (when);                                                   \
+    ctime_r(&now, time_str);                                               \
     time_str[strlen(time_str) - 1] = '\0';                                 \
     if (color_output && w_log_file == stdout) {                            \
       fprintf(w_log_file, "%s%s[ERROR]%s %s%s [%s:%d (%s)]:%s %s%s%s\n",   \
@@ -43,99 +138,926 @@ typedef unsigned char BYTE;
       fprintf(w_log_file, "[ERROR] %s [%s:%d (%s)]: %s\n", time_str, file, \
               line, func, msg);                                            \
     }                                                                      \
-    fflush(w_log_file);                                                    \
   } while (0)
 
-#define CANARY_SIZE 64
 #define CANARY_VALUE 0x7E
+// Keeps user pointers aligned like the system allocator's.
+#define CANARY_ALIGNMENT 16
+
+// Inline block header kept in the first bytes of the leading canary with
+// WATCHDOG_INLINE_HEADER. A block is found through `index` alone, once the
+// record there is cross-checked to point back at the block, so stale or
+// foreign headers never match. `check` ties the header to its block address
+// and size to tell a damaged header. `index` comes first: an underflow
+// reaches it last, so a block whose header it damaged is still found.
+#define WBH_MAGIC 0x5744424C4B484452ULL
+
+typedef struct WatchdogBlockHeader WBH;
+
+struct WatchdogBlockHeader {
+  size_t index;  // position in the owning shard's records
+  uint64_t check;
+  size_t size;
+  uint32_t site;
+  uint32_t reserved;
+};
+
+#if WATCHDOG_INLINE_HEADER
+#define CANARY_PREFIX_START sizeof(WBH)
+#else
+#define CANARY_PREFIX_START 0
+#endif
+
+// Allocations skipped by sampling carry only this tag in front of the user
+// pointer, so free can recognise them and hand them straight back. The tag is
+// tied to its address, which keeps canary bytes and stale tags from matching.
+#define WUT_MAGIC 0x5744534B49505044ULL
+
+typedef struct WatchdogUnsampledTag WUT;
+
+struct WatchdogUnsampledTag {
+  _Alignas(16) uint64_t tag;
+};
+
+// Header in front of every block when WATCHDOG_FEATURE_TRACKING is compiled
+// out, holding just what the counters need. `check` ties it to its address.
+#define WCH_MAGIC 0x57434E54u
+
+typedef struct WatchdogCountedHeader WCH;
+
+struct WatchdogCountedHeader {
+  _Alignas(16) uint64_t size;
+  uint32_t site;
+  uint32_t check;
+};
+
+// Interned (file, line, func) triple. Slots are claimed with a CAS on `key`
+// and published through `ready`, so lookups and inserts never take a lock.
+// Slot 0 is reserved for call sites that did not fit in the table. Each site
+// also aggregates the blocks allocated there; frees and reallocs are charged
+// to the site that allocated the block, so `live_bytes` is what it still holds.
+#define WCS_UNKNOWN 0
+
+typedef struct WatchdogCallSite WCS;
+
+struct WatchdogCallSite {
+  atomic_uint_fast64_t key;  // 0 while the slot is free
+  atomic_bool ready;
+  const char* key_file;  // pointers as passed by the caller
+  const char* key_func;
+  const char* file;  // copies of the above with WATCHDOG_COPY_STRINGS
+  const char* func;
+  unsigned int line;
+  // Written by every tracked operation at this site, so kept off the line
+  // that WCS_intern probes read.
+  _Alignas(64) atomic_size_t allocations;
+  atomic_size_t frees;
+  atomic_size_t bytes;
+  atomic_size_t live_bytes;
+  atomic_size_t peak_live_bytes;
+};
+
+// Live guarded blocks by the address of their guard page, so the SIGSEGV
+// handler finds a faulting block in a few probes, without locks. An entry is
+// claimed by moving `guard` from free to WGB_BUSY, filled in, then published
+// by storing the guard page's address; removal marks it free again.
+#define WGB_EMPTY 0  // never used; ends a probe
+#define WGB_REMOVED 1
+#define WGB_BUSY 2
+
+typedef struct WatchdogGuardedBlock WGB;
+
+struct WatchdogGuardedBlock {
+  atomic_uintptr_t guard;
+  uintptr_t user_ptr;
+  size_t size;
+  uint32_t site;
+};
+
+// Slot 0 of the stack depot stands for "no stack": capture was off or the
+// depot was full.
+#define WSD_NONE 0
+
+// Extra frames captured beyond the requested depth, so watchdog's own frames
+// can be dropped.
+#define WSD_SKIP_SLACK 8
+
+// A distinct allocation stack, stored once and referred to by its index.
+// Frames are raw return addresses; they are symbolized only for the report.
+typedef struct WatchdogStackDepotEntry WSD;
+
+struct WatchdogStackDepotEntry {
+  atomic_uint_fast64_t key;  // 0 while the slot is free
+  atomic_bool ready;
+  uint32_t depth;
+  void* frames[WATCHDOG_MAX_STACK_DEPTH];
+};
+
+// Copy of a call site's counters taken for the report.
+typedef struct WatchdogSiteSummary WSS;
+
+struct WatchdogSiteSummary {
+  uint32_t site;
+  size_t allocations;
+  size_t frees;
+  size_t bytes;
+  size_t live_bytes;
+  size_t peak_live_bytes;
+};
+
+// Blocks still live at exit from one call site, or from one stack when
+// stacks are captured, gathered by the report.
+typedef struct WatchdogLeakGroup WLG;
+
+#define W_LEAK_GROUPS (WATCHDOG_MAX_STACKS + WATCHDOG_MAX_CALL_SITES)
+
+struct WatchdogLeakGroup {
+  uint32_t site;
+  uint32_t stack;  // WSD_NONE unless stacks were captured
+  size_t blocks;
+  size_t bytes;
+  size_t smallest;
+  size_t largest;
+};
+
+// Live blocks and bytes of one call site in a snapshot.
+typedef struct WatchdogSnapshotEntry WSE;
+
+struct WatchdogSnapshotEntry {
+  uint32_t site;
+  size_t blocks;
+  size_t bytes;
+};
+
+struct WatchdogSnapshot {
+  uint64_t timestamp;  // CLOCK_MONOTONIC nanoseconds
+  size_t blocks;
+  size_t bytes;
+  size_t count;
+  WSE sites[];  // sites with live blocks, by ascending site id
+};
+
+// Change of one call site between two snapshots.
+typedef struct WatchdogSiteGrowth WSG;
+
+struct WatchdogSiteGrowth {
+  uint32_t site;
+  int64_t blocks;
+  int64_t bytes;
+  size_t live_blocks;
+  size_t live_bytes;
+};
+
+// Lifetimes of the blocks freed from one call site, with lifetime_profile.
+// Bucket `i` counts blocks freed within 10^i microseconds; the last one
+// counts the rest. Allocated on first use, one per call-site slot.
+#define WLT_BUCKETS 8
+// Fewest lifetimes a site needs before the report judges it.
+#define WLT_MIN_SAMPLES 16
+
+typedef struct WatchdogLifetimes WLT;
+
+struct WatchdogLifetimes {
+  atomic_size_t buckets[WLT_BUCKETS];
+  atomic_size_t short_lived;
+};
+
+typedef enum {
+  WSS_BY_BYTES,
+  WSS_BY_COUNT,
+  WSS_BY_LIVE_BYTES,
+  WSS_ORDER_COUNT,
+} WatchdogSiteOrder;
 
 typedef struct WatchdogAllocationMetadata WAM;
 
 struct WatchdogAllocationMetadata {
   void* ptr;
   size_t size;
-  const char* file;
-  unsigned int line;
-  const char* func;
-  bool freed;
+  uint32_t site;   // index into w_call_sites
+  uint32_t stack;  // index into w_stacks
+  // With lifetime_profile: CLOCK_MONOTONIC nanoseconds and the low bits of
+  // the process-wide allocation count at allocation; `born` is 0 otherwise.
+  uint64_t born;
+  uint32_t sequence;
+  bool scrub_reported;  // damage already logged by the canary scrubber
 };
 
-static void w_report(void);
-static void w_finalize(void);
-static void w_alloc_check_internal(void* ptr, const size_t size,
-                                   const char* file, const int line,
-                                   const char* func);
-static bool w_alloc_max_size_check_internal(const size_t size, const char* file,
-                                            const int line, const char* func);
-static void WAM_alloc_create_internal(void* ptr, const size_t size,
-                                      const char* file, const int line,
-                                      const char* func);
-static void WAM_realloc_update_internal(void* old_ptr, void* new_ptr,
-                                        const size_t new_size, const char* file,
-                                        const int line, const char* func);
-static void w_check_initialization_internal(void);
+// A retired record together with the call site that freed it. Kept in a
+// fixed-size ring so double frees and use of stale pointers can still be
+// reported with their original call site once the live record is gone.
+typedef struct WatchdogFreedRecord WFR;
+
+struct WatchdogFreedRecord {
+  WAM data;
+  uint32_t free_site;
+};
 
 #define WDA_DEFAULT_BUFFER_SIZE 10
 #define WDA_GROWTH_FACTOR 2
 
+// Live records are stored by value in one contiguous buffer per shard, so
+// tracking an allocation costs no system allocation of its own and the whole
+// set is released with a single free.
 typedef struct WatchdogDynamicArray WDA;
 
 struct WatchdogDynamicArray {
-  WAM** buffer;
+  WAM* buffer;
+  size_t size;
+  size_t capacity;
+};
+
+// Open-addressing (linear probing) index from the padded block pointer to the
+// position of its record, so lookups in free/realloc do not scan the array.
+// The pointer is kept in the entry so probing never touches the records.
+#define WHT_DEFAULT_CAPACITY 16
+#define WHT_MAX_LOAD_PERCENT 70
+
+typedef struct WatchdogHashEntry WHE;
+
+struct WatchdogHashEntry {
+  const void* ptr;  // NULL while the slot is empty
+  size_t index;     // position in the owning shard's records
+};
+
+typedef struct WatchdogHashTable WHT;
+
+struct WatchdogHashTable {
+  WHE* buffer;
+  size_t size;
+  size_t capacity;  // always a power of two
+};
+
+// FIFO of freed blocks held back from the system allocator, poisoned, until
+// the shard's share of the quarantine budget is exceeded. Entries keep both
+// call sites so corruption found on release can be traced.
+#define WQ_DEFAULT_CAPACITY 64
+
+typedef struct WatchdogQuarantine WQ;
+
+struct WatchdogQuarantine {
+  WFR* buffer;
+  size_t head;  // oldest entry
+  size_t size;
+  size_t capacity;
+  size_t bytes;  // user bytes held
+};
+
+typedef struct WatchdogFreedHistory WFH;
+
+struct WatchdogFreedHistory {
+  WFR* buffer;
+  size_t head;  // next slot to overwrite
   size_t size;
   size_t capacity;
 };
 
-static void WDA_push(void* ptr);
-static void WDA_pop(void);
-static void WDA_cleanup(void);
-static void WDA_expand_capacity_internal(void);
+// Tracking state is split into shards chosen by pointer hash. A block always
+// maps to the same shard, so its live record, index entry and freed history
+// are all guarded by one lock, and threads working on unrelated blocks rarely
+// contend.
+typedef struct WatchdogShard WS;
+
+struct WatchdogShard {
+  _Alignas(64) pthread_mutex_t mutex;
+  WDA records;
+  WHT index;
+  WFH history;
+  WQ quarantine;
+};
+
+// Log events share their layout with the binary trace records.
+typedef WatchdogTraceRecord WEV;
+
+// Binary trace output. Records are appended as they are logged; the call-site
+// table and final counts are written when the trace is closed.
+
+typedef struct WatchdogTraceWriter WTW;
+
+struct WatchdogTraceWriter {
+  FILE* file;
+  atomic_uint_fast64_t records;
+};
+
+// Bounded multi-producer/single-consumer ring (Vyukov's sequence-numbered
+// queue). Producers claim a slot with a CAS on `head`; the writer thread owns
+// `tail`. A slot is readable when its sequence is one past its position.
+#define WER_BATCH_SIZE 256
+#define WER_IDLE_SLEEP_NS 1000000
+
+typedef struct WatchdogEventSlot WES;
+
+struct WatchdogEventSlot {
+  atomic_size_t sequence;
+  WEV event;
+};
+
+typedef struct WatchdogEventRing WER;
+
+struct WatchdogEventRing {
+  WES* slots;
+  size_t capacity;  // always a power of two
+  WatchdogRingPolicy policy;
+  atomic_bool running;
+  atomic_bool stop;
+  atomic_size_t dropped;
+  pthread_t writer;
+  _Alignas(64) atomic_size_t head;
+  // Producers between checking `running` and publishing their slot. Shares
+  // the line every push already writes.
+  atomic_size_t producers;
+  _Alignas(64) size_t tail;
+};
+
+// Per-thread free lists of released blocks, one per 16-byte class of the
+// padded block (data plus both guards); class `c` holds blocks of
+// (c + 1) * 16 bytes. A cached block links to the next through its first
+// bytes. Hits and misses are folded into the global counters in batches, so
+// a hit touches no shared cache line.
+#define WTC_CLASS_SIZE 16
+#define WTC_CLASSES (WATCHDOG_CACHE_MAX_BLOCK / WTC_CLASS_SIZE)
+#define WTC_FOLD_INTERVAL 1024
+
+typedef struct WatchdogThreadCache WTC;
+
+struct WatchdogThreadCache {
+  void* heads[WTC_CLASSES];
+  size_t bytes;
+  uint32_t hits;
+  uint32_t misses;
+  bool registered;  // the thread-exit flush is set up for this thread
+};
+
+// Appends a snapshot diff to `file` each time `signal` arrives, against the
+// previous one (the first lists every live site). The handler only posts
+// `wake`; the snapshot is taken and written on the writer's thread.
+typedef struct WatchdogSnapshotWriter WSW;
+
+struct WatchdogSnapshotWriter {
+  int signal;
+  FILE* file;
+  sem_t wake;
+  pthread_t thread;
+  bool running;
+  atomic_bool stop;
+  struct sigaction previous;
+  WatchdogSnapshot* last;
+};
+
+// Damaged blocks the scrubber collects under one lock hold before it
+// releases the lock to report them.
+#define WATCHDOG_SCRUB_REPORT_BATCH 16
+
+// Background thread that calls `tick` every `interval_ns` until stopped. Used
+// for the stats line and the canary scrubber.
+typedef struct WatchdogPeriodicThread WPT;
+
+struct WatchdogPeriodicThread {
+  const char* name;
+  void (*start)(void);  // optional, runs on the thread before the first tick
+  void (*tick)(void);
+  bool idle_priority;  // run under SCHED_IDLE where available
+  pthread_t thread;
+  pthread_mutex_t mutex;  // guards `stop` for the timed wait
+  pthread_cond_t wake;
+  bool running;
+  bool stop;
+  uint64_t interval_ns;
+};
+
+static void w_report(void);
+static void w_finalize(void);
+static void w_free_internal(void* ptr, const uint32_t site,
+                            const uint64_t start);
+static void w_alloc_check_internal(void* ptr, const size_t size,
+                                   const char* file, const int line,
+                                   const char* func);
+static bool w_alloc_max_size_check_internal(const size_t size,
+                                            const uint32_t site);
+static void w_canary_fill_internal(void* original_ptr, const size_t size);
+static size_t w_canary_scan_internal(const BYTE* zone, const size_t length,
+                                     const BYTE value);
+static bool w_canary_intact_internal(const void* original_ptr,
+                                     const size_t size, int64_t* offset);
+static void WAM_alloc_create_internal(void* ptr, const size_t size,
+                                      const uint32_t site,
+                                      const uint32_t stack);
+static WAM WAM_retire_internal(WS* shard, const size_t index,
+                               const uint32_t site);
+static void w_lifetime_stamp_internal(WAM* data);
+static void w_lifetime_record_internal(const WAM* data);
+static size_t WLT_total_internal(const WLT* lifetimes);
+static size_t WLT_short_lived(uint32_t* sites, const size_t limit);
+static void w_report_lifetimes_internal(void);
+static void w_freed_error_internal(const WatchdogError error,
+                                   const WFR* record, const uint32_t site);
+static void w_release_block_internal(void* original_ptr, const size_t size);
+static void* w_block_alloc_internal(const size_t size);
+static size_t w_block_span_internal(const size_t size);
+static void* w_cache_take_internal(const size_t span);
+static bool w_cache_put_internal(void* block, const size_t span);
+static void w_cache_fold_internal(WTC* cache);
+static void w_cache_flush_internal(void* arg);
+static bool w_guarded_internal(const size_t size);
+static size_t w_guarded_span_internal(const size_t size);
+static size_t w_trailer_size_internal(const size_t size);
+static void w_guard_fault_internal(int signal, siginfo_t* info, void* context);
+static uintptr_t w_guard_page_internal(const void* original_ptr,
+                                       const size_t size);
+static void w_unmap_guarded_internal(const void* original_ptr,
+                                     const size_t size);
+static void WGB_insert(const void* original_ptr, const size_t size,
+                       const uint32_t site);
+static void WGB_remove(const void* original_ptr, const size_t size);
+static const WGB* WGB_find(const uintptr_t guard);
+static void w_signal_append_internal(char* buffer, size_t* length,
+                                     const size_t capacity, const char* text);
+static void w_signal_append_number_internal(char* buffer, size_t* length,
+                                            const size_t capacity,
+                                            uint64_t value,
+                                            const unsigned int base);
+static void w_quarantine_internal(WS* shard, const WAM* data,
+                                  const uint32_t free_site);
+static void w_quarantine_evict_internal(WS* shard, const size_t budget);
+static void w_quarantine_release_internal(const WFR* record);
+static void w_note_block_internal(const void* ptr);
+static bool w_prefix_mapped_internal(const void* ptr, const size_t bytes);
+static bool w_sample_internal(const size_t size);
+static size_t w_sample_interval_internal(void);
+static double w_sample_weight_internal(const size_t size);
+static void* w_unsampled_alloc_internal(const size_t size, const bool zero);
+static bool w_unsampled_internal(const void* ptr);
+static void w_unsampled_free_internal(void* ptr);
+static void* w_unsampled_realloc_internal(void* ptr, const size_t size);
+static void* w_counted_alloc_internal(const size_t size, const uint32_t site,
+                                      const bool zero);
+static WCH* w_counted_header_internal(const void* ptr);
+static void w_counted_free_internal(void* ptr, const uint32_t site);
+static void* w_counted_realloc_internal(void* ptr, const size_t size,
+                                        const uint32_t site);
+static bool w_verbose_internal(void);
+static void w_check_initialization_internal(void);
+#if WATCHDOG_PRELOAD
+static WatchdogOptions w_preload_options_internal(void);
+static void w_preload_describe_internal(WCS* site, const void* address);
+#endif
 static void w_configure_log_destination_internal(bool enable_file_log);
 
+static void w_log_event_internal(const WatchdogEventType op, const void* ptr,
+                                 const size_t size, const uint32_t site,
+                                 const uint64_t timestamp);
+static void w_log_error_internal(const WatchdogError error,
+                                 const uint32_t site);
+static void w_log_bounds_error_internal(const void* ptr, const size_t size,
+                                        const int64_t offset,
+                                        const uint32_t site);
+static void w_log_dispatch_internal(const WEV* event);
+static void w_log_write_internal(const WEV* event);
+static void w_log_flush_internal(void);
+static uint32_t w_thread_id_internal(void);
+static size_t w_metadata_overhead_internal(void);
+static void w_report_sites_internal(const WSS* summaries, const size_t count,
+                                    const char* title);
+static void w_report_leaks_internal(const WLG* groups, const size_t count,
+                                    const size_t listed);
+static int WLG_compare_internal(const void* a, const void* b);
+static void w_snapshot_diff_internal(FILE* out, const WatchdogSnapshot* before,
+                                     const WatchdogSnapshot* after);
+static int WSG_compare_internal(const void* a, const void* b);
+
+static uint32_t WCS_intern(const char* file, const int line,
+                           const char* func);
+static void WCS_init(void);
+static void WCS_cleanup(void);
+static uint32_t WSD_capture(const void* caller);
+static uint32_t WSD_intern(void* const* frames, const uint32_t depth);
+static void WSD_print_internal(const uint32_t stack);
+static size_t WCS_top(WSS* summaries, const size_t limit,
+                      const WatchdogSiteOrder order);
+static size_t WSS_key_internal(const WSS* summary,
+                               const WatchdogSiteOrder order);
+
+static void WTW_open(const char* path);
+static void WTW_write(const WEV* event);
+static void WTW_close(void);
+
+static void WER_start(size_t capacity, WatchdogRingPolicy policy);
+static void WER_stop(void);
+static void WER_cleanup(void);
+static bool WER_push(const WEV* event, bool may_drop);
+static bool WER_pop(WEV* event);
+static void* WER_writer_internal(void* arg);
+
+static void WPT_start(WPT* periodic, size_t interval_ms);
+static void WPT_stop(WPT* periodic);
+static void* WPT_thread_internal(void* arg);
+static void w_stats_start_internal(void);
+static void w_stats_tick_internal(void);
+static void w_scrub_tick_internal(void);
+
+static void WSW_start(const int signal, const char* path);
+static void WSW_stop(void);
+static void* WSW_thread_internal(void* arg);
+static void w_snapshot_signal_internal(int signal);
+static void w_join_internal(pthread_t thread);
+static void w_fork_child_internal(void);
+
+static WS* WS_for_internal(const void* ptr);
+static void WS_init(WS* shard);
+static void WS_insert(WS* shard, const WAM* data);
+static bool WS_find(const WS* shard, const void* ptr, size_t* index);
+static void WS_remove(WS* shard, const size_t index);
+static void WS_resize(WS* shard, const size_t index, const size_t size,
+                      const uint32_t site, const uint32_t stack);
+#if !WATCHDOG_PRELOAD
+static void WS_clear(WS* shard);
+#endif
+static void WS_cleanup(WS* shard);
+
+#if WATCHDOG_INLINE_HEADER
+static uint64_t WBH_check_internal(const void* ptr, const size_t size);
+static void WBH_write(void* ptr, const size_t size, const size_t index,
+                      const uint32_t site);
+static bool WBH_find(const WS* shard, const void* ptr, size_t* index);
+#endif
+
+static void WDA_init(WDA* array);
+static size_t WDA_push(WDA* array, const WAM* data);
+static bool WDA_remove(WDA* array, const size_t index);
+static void WDA_cleanup(WDA* array);
+static void WDA_expand_capacity_internal(WDA* array);
+
+static size_t WHT_hash_internal(const void* ptr);
+static void WHT_init(WHT* table);
+static void WHT_cleanup(WHT* table);
+#if !WATCHDOG_INLINE_HEADER
+static void WHT_insert(WHT* table, const void* ptr, const size_t index);
+static bool WHT_find(const WHT* table, const void* ptr, size_t* index);
+static void WHT_update(WHT* table, const void* ptr, const size_t index);
+static void WHT_remove(WHT* table, const void* ptr);
+static void WHT_expand_capacity_internal(WHT* table);
+#endif
+
+static void WFH_init(WFH* history, size_t capacity);
+static void WFH_push(WFH* history, const WAM* data, const uint32_t free_site);
+static bool WFH_find(const WFH* history, const void* ptr, WFR* out);
+static void WFH_cleanup(WFH* history);
+
+static void WQ_init(WQ* quarantine);
+static void WQ_push(WQ* quarantine, const WAM* data, const uint32_t free_site);
+static WFR WQ_pop(WQ* quarantine);
+static bool WQ_find(const WQ* quarantine, const void* ptr, WFR* out);
+static void WQ_cleanup(WQ* quarantine);
+
+// Counters are updated without any lock held, so every field is atomic.
 typedef struct {
-  size_t total_allocations;
-  size_t total_frees;
-  size_t current_usage;
-  size_t peak_usage;
-  double total_time_spent;  // in seconds
+  atomic_size_t total_allocations;
+  atomic_size_t total_frees;
+  atomic_size_t current_usage;
+  atomic_size_t peak_usage;
+  // With sampling, usage scaled up by each sampled allocation's weight.
+  atomic_size_t estimated_usage;
+  atomic_size_t estimated_peak_usage;
 } WatchdogStats;
 
 static WatchdogStats w_stats = {0};
 
+static void w_stats_alloc_internal(const size_t size, const uint32_t site);
+static void w_stats_free_internal(const size_t size, const uint32_t site);
+static void w_stats_peak_internal(atomic_size_t* peak, const size_t usage);
+
+// Latency histograms, one per operation and one per phase of the tracked
+// path. Buckets are log-linear as in HdrHistogram: values below
+// WLH_SUB_BUCKETS get a bucket each, larger ones WLH_SUB_BUCKETS per power of
+// two, so every recorded value is within 1/16 of its bucket's bounds.
+// Samples are in clock ticks and only converted to nanoseconds in the report.
+#define WLH_SUB_BUCKET_BITS 4
+#define WLH_SUB_BUCKETS (1 << WLH_SUB_BUCKET_BITS)
+#define WLH_BUCKETS ((64 - WLH_SUB_BUCKET_BITS + 1) * WLH_SUB_BUCKETS)
+
+typedef enum {
+  WLH_MALLOC,
+  WLH_CALLOC,
+  WLH_REALLOC,
+  WLH_FREE,
+  WLH_LOCK_WAIT,         // acquiring a shard lock
+  WLH_SYSTEM_ALLOCATOR,  // the underlying malloc and free
+  WLH_CANARY,            // filling and checking guard zones
+  WLH_LOGGING,           // formatting, queueing or writing an event
+  WLH_COUNT,
+} WatchdogLatencyKind;
+
+typedef struct WatchdogLatencyHistogram WLH;
+
+struct WatchdogLatencyHistogram {
+  atomic_uint_fast64_t buckets[WLH_BUCKETS];
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t total;
+  atomic_uint_fast64_t max;
+};
+
+// One thread's histograms. Only the owning thread writes them, with plain
+// loads and stores, so recording takes no locked instructions and shares no
+// cache lines; the report sums every set into w_latency. A set outlives its
+// thread and is handed to the next thread that needs one, which keeps adding
+// to the same totals.
+typedef struct WatchdogLatencySet WLS;
+
+struct WatchdogLatencySet {
+  WLH histograms[WLH_COUNT];
+  atomic_bool owned;
+  WLS* next;
+};
+
+static WLH w_latency[WLH_COUNT];
+static _Atomic(WLS*) w_latency_sets = NULL;
+static atomic_size_t w_latency_set_count = 0;
+static WATCHDOG_TLS WLS* w_latency_set = NULL;
+// Hands a thread's set back when the thread exits.
+static pthread_key_t w_latency_key;
+static bool w_latency_key_ready = false;
+
+static void WLH_record(const WatchdogLatencyKind kind, const uint64_t start);
+static void WLH_add_internal(const WatchdogLatencyKind kind,
+                             const uint64_t elapsed);
+static WLS* WLS_claim_internal(void);
+static void WLS_release_internal(void* arg);
+static void WLH_merge_internal(void);
+static size_t WLH_bucket_internal(const uint64_t value);
+static uint64_t WLH_bucket_limit_internal(const size_t bucket);
+static uint64_t WLH_percentile(const WLH* histogram, const double quantile);
+static double w_ns_per_tick_internal(void);
+static void w_report_latency_internal(const double ns_per_tick);
+static void w_shard_lock_internal(WS* shard);
+
 // Helper for high-resolution timing
-static double w_get_time() {
+static uint64_t w_get_time(void) {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
-  return ts.tv_sec + ts.tv_nsec * 1e-9;
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Clock for the latency histograms: the CPU's constant-rate counter where
+// it can be read without a system call, CLOCK_MONOTONIC elsewhere.
+static inline uint64_t w_ticks(void) {
+  if (!W_HAS(LATENCY)) {
+    return 0;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return w_get_time();
+#endif
 }
 
-static WDA watchdog;
+// Both clocks read at the first initialization, to derive the tick rate.
+static uint64_t w_ticks_base = 0;
+static uint64_t w_time_base = 0;
+
+// Difference between CLOCK_REALTIME and CLOCK_MONOTONIC, captured once so
+// event timestamps can be printed as wall-clock time.
+static int64_t w_realtime_offset = 0;
+
+static WS w_shards[WATCHDOG_SHARDS];
+static WCS w_call_sites[WATCHDOG_MAX_CALL_SITES];
+static WGB w_guarded_blocks[WATCHDOG_MAX_GUARDED_BLOCKS];
+#if WATCHDOG_INLINE_HEADER
+// First two pages of recently released guarded blocks, left mapped read-only
+// and zero-filled so a late free or realloc of one reads a header that does
+// not match instead of faulting. The oldest is unmapped when the ring wraps.
+static uintptr_t w_retired_guarded[WATCHDOG_MAX_GUARDED_BLOCKS];
+static size_t w_retired_next = 0;
+static pthread_mutex_t w_retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static WSD w_stacks[WATCHDOG_MAX_STACKS];
+// Indexed like w_call_sites; NULL until lifetime_profile is first enabled.
+static WLT* w_lifetimes = NULL;
+static atomic_size_t w_stack_count = 0;
+static WER w_ring;
+static WPT w_reporter = {.name = "stats",
+                         .start = w_stats_start_internal,
+                         .tick = w_stats_tick_internal,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .wake = PTHREAD_COND_INITIALIZER};
+static WPT w_scrubber = {.name = "scrubber",
+                         .tick = w_scrub_tick_internal,
+                         .idle_priority = true,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .wake = PTHREAD_COND_INITIALIZER};
+
+// Counters of the last stats line, owned by the stats thread.
+static WatchdogStatsSnapshot w_stats_last;
+
+// Next block the scrubber checks: a shard and a position in its records.
+// Owned by the scrubber thread. Records move when others are retired, so a
+// pass may skip or repeat a few blocks; the next pass covers them.
+static size_t w_scrub_shard = 0;
+static size_t w_scrub_index = 0;
+static WTW w_trace;
+static WSW w_snapshots;
+static bool w_ring_used = false;
+// SIGSEGV disposition replaced by the guard page handler.
+static struct sigaction w_previous_segv;
+// Flushes a thread's block cache when the thread exits.
+static pthread_key_t w_cache_key;
+static atomic_size_t w_cache_hits = 0;
+static atomic_size_t w_cache_misses = 0;
+
+// Lowest and highest block addresses handed out. With inline headers or
+// sampling, pointers outside this range are rejected before the bytes in
+// front of them are read.
+static atomic_uintptr_t w_block_min = UINTPTR_MAX;
+static atomic_uintptr_t w_block_max = 0;
+
+static atomic_uint w_next_thread_id = 1;
+static WATCHDOG_TLS uint32_t w_thread_id = 0;
+
+// Non-zero while this thread runs watchdog code. The preload interposers
+// send allocations made in that state (by watchdog itself or by libc on its
+// behalf) straight to the system allocator.
+static WATCHDOG_TLS unsigned int w_reentry = 0;
+
+// Bytes this thread may still allocate before the next sampled allocation,
+// and the generator that draws the intervals.
+static WATCHDOG_TLS size_t w_sample_countdown = 0;
+static WATCHDOG_TLS uint64_t w_sample_seed = 0;
+
+// Blocks this thread released and may reuse, with `thread_cache_bytes`.
+static WATCHDOG_TLS WTC w_cache;
+
+WatchdogOptions w_default_options(void) {
+  WatchdogOptions options = {
+      .enable_verbose_log = true,
+      .log_to_file = false,
+      .enable_color_output = false,
+      .log_mode = WATCHDOG_LOG_SYNC,
+      .ring_capacity = WATCHDOG_DEFAULT_RING_CAPACITY,
+      .ring_full_policy = WATCHDOG_RING_DROP,
+      .log_format = WATCHDOG_FORMAT_TEXT,
+      .trace_file = "watchdog.trace",
+      .canary_size = WATCHDOG_DEFAULT_CANARY_SIZE,
+      .sample_rate = 0,
+      .report_top_sites = 10,
+      .report_leak_details = 100,
+      .stack_depth = 0,
+      .lifetime_profile = false,
+      .short_lived_ns = 10000,
+      .short_lived_allocations = 100,
+      .stats_interval_ms = 0,
+      .quarantine_bytes = 0,
+      .quarantine_poison = 0xDD,
+      .quarantine_verify = true,
+      .scrub_interval_ms = 0,
+      .scrub_blocks_per_tick = 256,
+      .guard_page_threshold = 0,
+      .thread_cache_bytes = 0,
+      .snapshot_signal = 0,
+      .snapshot_file = "watchdog.snapshot",
+  };
+  return options;
+}
 
 void w_init(bool enable_verbose_log, bool enable_file_log,
             bool enable_color_output) {
+  WatchdogOptions options = w_default_options();
+  options.enable_verbose_log = enable_verbose_log;
+  options.log_to_file = enable_file_log;
+  options.enable_color_output = enable_color_output;
+  w_init_with_options(&options);
+}
+
+void w_init_with_options(const WatchdogOptions* options) {
   pthread_mutex_lock(&w_mutex);
-  if (!w_initialized) {
-    watchdog.size = 0;
-    watchdog.capacity = WDA_DEFAULT_BUFFER_SIZE;
-    watchdog.buffer = malloc(sizeof *watchdog.buffer * watchdog.capacity);
-    w_alloc_check_internal(watchdog.buffer,
-                           sizeof *watchdog.buffer * watchdog.capacity,
-                           __FILE__, __LINE__, __func__);
-    w_initialized = true;
+  if (!atomic_load_explicit(&w_initialized, memory_order_relaxed)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    w_realtime_offset =
+        (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t)w_get_time();
+    w_ticks_base = w_ticks();
+    w_time_base = w_get_time();
+    // Nothing is tracked yet, so this is the only time the guards can change.
+    // Without canaries, only the inline header (if any) is kept in front.
+    size_t minimum = CANARY_PREFIX_START + CANARY_ALIGNMENT;
+    canary_size = options->canary_size > minimum ? options->canary_size
+                                                 : minimum;
+    canary_size = (canary_size + CANARY_ALIGNMENT - 1) &
+                  ~(size_t)(CANARY_ALIGNMENT - 1);
+    if (!W_HAS(CANARIES)) {
+      canary_size = CANARY_PREFIX_START;
+    }
+    // Sample weights are fixed when a block is tracked, so is the rate.
+    // Without tracking every block is counted exactly; there is nothing to
+    // sample.
+    sample_rate = W_HAS(TRACKING) ? options->sample_rate : 0;
+    quarantine_poison = options->quarantine_poison;
+    // Live mappings depend on both.
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > 0) {
+      w_page_size = (size_t)page_size;
+    }
+    guard_page_threshold = W_HAS(TRACKING) ? options->guard_page_threshold : 0;
+    if (guard_page_threshold) {
+      struct sigaction action = {.sa_sigaction = w_guard_fault_internal,
+                                 .sa_flags = SA_SIGINFO | SA_NODEFER};
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGSEGV, &action, &w_previous_segv);
+    }
+    w_latency_key_ready =
+        W_HAS(LATENCY) &&
+        pthread_key_create(&w_latency_key, WLS_release_internal) == 0;
+    thread_cache_bytes = W_HAS(TRACKING) ? options->thread_cache_bytes : 0;
+    if (thread_cache_bytes &&
+        pthread_key_create(&w_cache_key, w_cache_flush_internal) != 0) {
+      thread_cache_bytes = 0;
+    }
+    pthread_atfork(NULL, NULL, w_fork_child_internal);
+    WCS_init();
+    for (size_t i = 0; i < WATCHDOG_SHARDS; i++) {
+      WS_init(&w_shards[i]);
+    }
+  }
+  // Drain whatever is queued to the old destination before switching.
+  WSW_stop();
+  WPT_stop(&w_scrubber);
+  WPT_stop(&w_reporter);
+  WER_stop();
+  WTW_close();
+  verbose_log = options->enable_verbose_log;
+  color_output = options->enable_color_output;
+  w_configure_log_destination_internal(options->log_to_file);
+  report_top_sites = options->report_top_sites;
+  report_leak_details = options->report_leak_details;
+  stack_depth = options->stack_depth < WATCHDOG_MAX_STACK_DEPTH
+                    ? options->stack_depth
+                    : WATCHDOG_MAX_STACK_DEPTH;
+  if (W_HAS(TRACKING) && options->lifetime_profile && !w_lifetimes) {
+    w_lifetimes = calloc(WATCHDOG_MAX_CALL_SITES, sizeof *w_lifetimes);
+  }
+  short_lived_ns = options->short_lived_ns;
+  short_lived_allocations = options->short_lived_allocations;
+  // Blocks stamped earlier keep being recorded after it is turned off.
+  lifetime_profile = options->lifetime_profile && w_lifetimes;
+  if (stack_depth) {
+    // The first backtrace loads the unwinder, which allocates.
+    void* frame;
+    w_reentry++;
+    backtrace(&frame, 1);
+    w_reentry--;
+  }
+  quarantine_bytes = options->quarantine_bytes;
+  quarantine_verify = options->quarantine_verify;
+  log_format = options->log_format;
+  if (log_format == WATCHDOG_FORMAT_BINARY) {
+    WTW_open(options->trace_file);
+  }
+  if (options->log_mode == WATCHDOG_LOG_ASYNC) {
+    WER_start(options->ring_capacity, options->ring_full_policy);
+  }
+  scrub_blocks_per_tick = options->scrub_blocks_per_tick;
+  if (options->stats_interval_ms) {
+    WPT_start(&w_reporter, options->stats_interval_ms);
+  }
+  if (W_HAS(CANARIES) && options->scrub_interval_ms && scrub_blocks_per_tick) {
+    WPT_start(&w_scrubber, options->scrub_interval_ms);
+  }
+  if (options->snapshot_signal) {
+    WSW_start(options->snapshot_signal, options->snapshot_file);
   }
-  verbose_log = enable_verbose_log;
-  color_output = enable_color_output;
-  w_configure_log_destination_internal(enable_file_log);
   if (!w_atexit_registered) {
     atexit(w_finalize);
     w_atexit_registered = true;
   }
+  atomic_store_explicit(&w_initialized, true, memory_order_release);
   pthread_mutex_unlock(&w_mutex);
 }
 
 void w_finalize(void) {
+  w_reentry++;
+  WSW_stop();
+  WPT_stop(&w_scrubber);
+  WPT_stop(&w_reporter);
+  w_cache_fold_internal(&w_cache);
   w_report();
-  WDA_cleanup();
+#if WATCHDOG_PRELOAD
+  // Handlers and destructors that run after this one may still free tracked
+  // blocks or log errors, so the tables and the text log stay alive until
+  // exit. Only the trace is finished; later errors go to the text log.
+  WTW_close();
+  log_format = WATCHDOG_FORMAT_TEXT;
+  w_reentry--;
+  return;
+#endif
+  for (size_t i = 0; i < WATCHDOG_SHARDS; i++) {
+    WS_cleanup(&w_shards[i]);
+  }
+  w_cache_flush_internal(&w_cache);
+  WER_cleanup();
+  WTW_close();
+  WCS_cleanup();
 
   if (w_log_file && w_log_file != stdout) {
     fclose(w_log_file);
@@ -143,225 +1065,411 @@ void w_finalize(void) {
   }
 }
 
+// Counters are read without a lock, so they are individually exact but may
+// be a few operations apart. Frees are read before allocations and usage
+// before its peak, so a snapshot never shows more frees than allocations or
+// usage above the peak.
+WatchdogStatsSnapshot w_get_stats(void) {
+  WatchdogStatsSnapshot stats = {.timestamp = w_get_time()};
+  stats.total_frees =
+      atomic_load_explicit(&w_stats.total_frees, memory_order_acquire);
+  stats.total_allocations =
+      atomic_load_explicit(&w_stats.total_allocations, memory_order_acquire);
+  stats.live_allocations = stats.total_allocations - stats.total_frees;
+  stats.current_usage = atomic_load(&w_stats.current_usage);
+  stats.peak_usage = atomic_load(&w_stats.peak_usage);
+  if (stats.peak_usage < stats.current_usage) {
+    stats.peak_usage = stats.current_usage;
+  }
+  if (sample_rate) {
+    stats.estimated_usage = atomic_load(&w_stats.estimated_usage);
+    stats.estimated_peak_usage = atomic_load(&w_stats.estimated_peak_usage);
+    if (stats.estimated_peak_usage < stats.estimated_usage) {
+      stats.estimated_peak_usage = stats.estimated_usage;
+    }
+  } else {
+    stats.estimated_usage = stats.current_usage;
+    stats.estimated_peak_usage = stats.peak_usage;
+  }
+  stats.dropped_events = atomic_load(&w_ring.dropped);
+  return stats;
+}
+
+// Reads the per-site counters like w_get_stats, so allocating threads are
+// never blocked. Counts of different sites may be a few operations apart.
+WatchdogSnapshot* w_snapshot(void) {
+  w_reentry++;
+  WatchdogSnapshot* snapshot =
+      malloc(sizeof *snapshot + WATCHDOG_MAX_CALL_SITES * sizeof(WSE));
+  if (!snapshot) {
+    w_reentry--;
+    return NULL;
+  }
+  snapshot->timestamp = w_get_time();
+  snapshot->blocks = 0;
+  snapshot->bytes = 0;
+  snapshot->count = 0;
+  for (uint32_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    WCS* site = &w_call_sites[i];
+    if (!atomic_load_explicit(&site->ready, memory_order_acquire)) {
+      continue;
+    }
+    // Frees first, so a site never shows more frees than allocations.
+    size_t frees = atomic_load_explicit(&site->frees, memory_order_acquire);
+    size_t allocations =
+        atomic_load_explicit(&site->allocations, memory_order_acquire);
+    size_t bytes =
+        atomic_load_explicit(&site->live_bytes, memory_order_relaxed);
+    if (allocations == frees) {
+      continue;
+    }
+    snapshot->sites[snapshot->count++] =
+        (WSE){.site = i, .blocks = allocations - frees, .bytes = bytes};
+    snapshot->blocks += allocations - frees;
+    snapshot->bytes += bytes;
+  }
+  WatchdogSnapshot* fitted = realloc(
+      snapshot, sizeof *snapshot + snapshot->count * sizeof *snapshot->sites);
+  if (fitted) {
+    snapshot = fitted;
+  }
+  w_reentry--;
+  return snapshot;
+}
+
+void w_snapshot_diff(const WatchdogSnapshot* before,
+                     const WatchdogSnapshot* after) {
+  if (!after || !w_log_file) {
+    return;
+  }
+  w_reentry++;
+  // Keeps the asynchronous writer's lines out of the middle of the diff.
+  flockfile(w_log_file);
+  w_snapshot_diff_internal(w_log_file, before, after);
+  fflush(w_log_file);
+  funlockfile(w_log_file);
+  w_reentry--;
+}
+
+void w_snapshot_free(WatchdogSnapshot* snapshot) {
+  w_reentry++;
+  free(snapshot);
+  w_reentry--;
+}
+
 void* w_malloc(const size_t size, const char* file, const int line,
                const char* func) {
-  double start_time = w_get_time();
   w_check_initialization_internal();
+  if (!W_HAS(TRACKING)) {
+    return w_counted_alloc_internal(size, WCS_intern(file, line, func), false);
+  }
+  if (size && !w_sample_internal(size)) {
+    return w_unsampled_alloc_internal(size, false);
+  }
+  uint64_t start = w_ticks();
+  uint32_t site = WCS_intern(file, line, func);
 
-  pthread_mutex_lock(&w_mutex);
-
-  if (!w_alloc_max_size_check_internal(size, file, line, func)) {
-    pthread_mutex_unlock(&w_mutex);
+  if (!w_alloc_max_size_check_internal(size, site)) {
     return NULL;
   }
   if (!size) {
-    pthread_mutex_unlock(&w_mutex);
     return NULL;
   }
 
-  w_stats.total_allocations++;
-  w_stats.current_usage += size;
-  if (w_stats.current_usage > w_stats.peak_usage) {
-    w_stats.peak_usage = w_stats.current_usage;
-  }
-
-  void* ptr = malloc(size + (2 * CANARY_SIZE));
+  uint32_t stack = stack_depth ? WSD_capture(W_STACK_ANCHOR(func)) : WSD_NONE;
+  void* ptr = w_block_alloc_internal(size);
   w_alloc_check_internal(ptr, size, __FILE__, __LINE__, __func__);
 
-  WAM_alloc_create_internal(ptr, size, file, line, func);
-  memset(ptr, CANARY_VALUE, CANARY_SIZE);
-  memset((BYTE*)ptr + size + CANARY_SIZE, CANARY_VALUE, CANARY_SIZE);
+  w_canary_fill_internal(ptr, size);
+  WAM_alloc_create_internal(ptr, size, site, stack);
+  w_stats_alloc_internal(size, site);
 
-  if (verbose_log) {
-    WATCHDOG_LOG("MALLOC", (void*)((BYTE*)ptr + CANARY_SIZE), size, file, line,
-                 func);
+  if (w_verbose_internal()) {
+    w_log_event_internal(WATCHDOG_EVENT_MALLOC, (BYTE*)ptr + canary_size, size,
+                         site, w_get_time());
   }
 
-  w_stats.total_time_spent += (w_get_time() - start_time);
-  pthread_mutex_unlock(&w_mutex);
-
-  return (BYTE*)ptr + CANARY_SIZE;
+  WLH_record(WLH_MALLOC, start);
+  return (BYTE*)ptr + canary_size;
 }
 
 void* w_realloc(void* old_ptr, size_t size, const char* file, const int line,
                 const char* func) {
-  double start_time = w_get_time();
   w_check_initialization_internal();
 
   if (!old_ptr) {
     return w_malloc(size, file, line, func);
   }
+  if (!W_HAS(TRACKING)) {
+    return w_counted_realloc_internal(old_ptr, size,
+                                      WCS_intern(file, line, func));
+  }
+  // Skipped blocks stay skipped; tracked blocks stay tracked.
+  if (w_unsampled_internal(old_ptr)) {
+    return w_unsampled_realloc_internal(old_ptr, size);
+  }
+  uint64_t start = w_ticks();
 
-  pthread_mutex_lock(&w_mutex);
+  uint32_t site = WCS_intern(file, line, func);
 
   if (!size) {
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
-    w_free(old_ptr, file, line, func);
+    w_free_internal(old_ptr, site, start);
     return NULL;
   }
 
-  if (!w_alloc_max_size_check_internal(size, file, line, func)) {
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
+  if (!w_alloc_max_size_check_internal(size, site)) {
+    WLH_record(WLH_REALLOC, start);
     return NULL;
   }
 
-  size_t old_ptr_size = 0;
-  void* original_ptr = (BYTE*)old_ptr - CANARY_SIZE;
-  bool found = false;
-  for (int i = (int)watchdog.size - 1; i >= 0; i--) {
-    if (watchdog.buffer[i]->ptr == original_ptr) {
-      found = true;
-      old_ptr_size = watchdog.buffer[i]->size;
-      if (watchdog.buffer[i]->freed) {
-        WATCHDOG_LOG_ERROR("Attempt to reallocate a freed pointer.", file, line,
-                           func);
-        w_stats.total_time_spent += (w_get_time() - start_time);
-        pthread_mutex_unlock(&w_mutex);
-        return NULL;
-      } else {
-        break;
-      }
-    }
-  }
+  void* original_ptr = (BYTE*)old_ptr - canary_size;
+  WS* shard = WS_for_internal(original_ptr);
+  WFR freed_record;
+  // Captured before the lock; unwinding is the slow part.
+  uint32_t stack = stack_depth ? WSD_capture(W_STACK_ANCHOR(func)) : WSD_NONE;
 
-  if (!found) {
-    WATCHDOG_LOG_ERROR("Attempt to reallocate unallocated/untracked memory.",
-                       file, line, func);
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
+  w_shard_lock_internal(shard);
+  size_t index;
+  if (!WS_find(shard, original_ptr, &index)) {
+    // Quarantined blocks outlive their history entries; they are still
+    // freed, never foreign.
+    bool was_freed =
+        WFH_find(&shard->history, original_ptr, &freed_record) ||
+        WQ_find(&shard->quarantine, original_ptr, &freed_record);
+    pthread_mutex_unlock(&shard->mutex);
+    if (was_freed) {
+      w_freed_error_internal(WATCHDOG_ERROR_FREED_REALLOC, &freed_record, site);
+    } else {
+#if WATCHDOG_PRELOAD
+      // Allocated before watchdog was loaded, or by libc on its behalf.
+      WLH_record(WLH_REALLOC, start);
+      return realloc(old_ptr, size);
+#endif
+      w_log_error_internal(WATCHDOG_ERROR_UNTRACKED_REALLOC, site);
+    }
+    WLH_record(WLH_REALLOC, start);
     return NULL;
   }
+  // The old guards are checked before the system allocator touches the
+  // block. It is resized with the shard lock held: if it moves, its old
+  // address must not be handed out and tracked by another thread before the
+  // record is gone.
+  WAM old_data = shard->records.buffer[index];
+  int64_t offset;
+  uint64_t phase = w_ticks();
+  bool intact = w_canary_intact_internal(original_ptr, old_data.size, &offset);
+  WLH_record(WLH_CANARY, phase);
 
-  w_stats.total_allocations++;
-  w_stats.current_usage += size;
-  if (w_stats.current_usage > w_stats.peak_usage) {
-    w_stats.peak_usage = w_stats.current_usage;
-  }
+  void* new_ptr;
+  // Mapped blocks cannot be resized by the system allocator, and with a
+  // quarantine the old block must be held back and poisoned like a freed
+  // one, so writes through stale pointers are caught. Either way the data is
+  // copied into a new block and the old one retired.
+  bool copied = quarantine_bytes || w_guarded_internal(old_data.size) ||
+                w_guarded_internal(size);
+  if (copied) {
+    new_ptr = w_block_alloc_internal(size);
+    if (!new_ptr) {
+      pthread_mutex_unlock(&shard->mutex);
+      w_alloc_check_internal(new_ptr, size, __FILE__, __LINE__, __func__);
+    }
+    memcpy((BYTE*)new_ptr + canary_size, old_ptr,
+           old_data.size < size ? old_data.size : size);
+    w_canary_fill_internal(new_ptr, size);
+  } else {
+#if WATCHDOG_INLINE_HEADER
+    // Rewritten below; a header left behind at a freed address must not
+    // validate.
+    ((WBH*)original_ptr)->check = 0;
+#endif
+    phase = w_ticks();
+    new_ptr = realloc(original_ptr, w_block_span_internal(size));
+    WLH_record(WLH_SYSTEM_ALLOCATOR, phase);
+    if (!new_ptr) {
+      pthread_mutex_unlock(&shard->mutex);
+      w_alloc_check_internal(new_ptr, size, __FILE__, __LINE__, __func__);
+    }
 
-  void* new_ptr = malloc(size + (2 * CANARY_SIZE));
-  w_alloc_check_internal(new_ptr, size, __FILE__, __LINE__, __func__);
+    // The leading guard moved with the data, so only the trailing one needs
+    // stamping, unless the old guards were damaged (already reported below).
+    if (intact) {
+      phase = w_ticks();
+      memset((BYTE*)new_ptr + canary_size + size, CANARY_VALUE, canary_size);
+      WLH_record(WLH_CANARY, phase);
+    } else {
+      w_canary_fill_internal(new_ptr, size);
+    }
+  }
 
-  memset(new_ptr, CANARY_VALUE, size + (2 * CANARY_SIZE));
-  size_t move_size;
-  if (old_ptr_size > size || !old_ptr_size) {
-    move_size = size;
+  if (new_ptr == original_ptr) {
+    WS_resize(shard, index, size, site, stack);
+    pthread_mutex_unlock(&shard->mutex);
   } else {
-    move_size = old_ptr_size;
+    WAM_retire_internal(shard, index, site);
+    pthread_mutex_unlock(&shard->mutex);
+    WAM_alloc_create_internal(new_ptr, size, site, stack);
+    if (copied && quarantine_bytes) {
+      w_quarantine_internal(shard, &old_data, site);
+    } else if (copied) {
+      w_release_block_internal(original_ptr, old_data.size);
+    }
   }
-  memcpy((BYTE*)new_ptr + CANARY_SIZE, old_ptr, move_size);
 
-  WAM_realloc_update_internal(old_ptr, new_ptr, size, file, line, func);
+  if (!intact) {
+    w_log_bounds_error_internal(old_ptr, old_data.size, offset, site);
+  }
+  if (w_verbose_internal()) {
+    w_log_event_internal(WATCHDOG_EVENT_FREE, old_ptr, old_data.size,
+                         old_data.site, w_get_time());
+  }
+  // Moved or not, the old block's lifetime ends here, as if it were freed.
+  w_lifetime_record_internal(&old_data);
+  w_stats_free_internal(old_data.size, old_data.site);
+  w_stats_alloc_internal(size, site);
 
-  if (verbose_log) {
-    WATCHDOG_LOG("REALLOC", (void*)((BYTE*)new_ptr + CANARY_SIZE), size, file,
-                 line, func);
+  if (w_verbose_internal()) {
+    WEV event = {
+        .timestamp = w_get_time(),
+        .ptr = (uint64_t)(uintptr_t)((BYTE*)new_ptr + canary_size),
+        .size = size,
+        .aux = (uint64_t)(uintptr_t)old_ptr,
+        .site = site,
+        .thread = w_thread_id_internal(),
+        .op = WATCHDOG_EVENT_REALLOC,
+    };
+    w_log_dispatch_internal(&event);
   }
-  w_stats.total_time_spent += (w_get_time() - start_time);
-  pthread_mutex_unlock(&w_mutex);
+  WLH_record(WLH_REALLOC, start);
 
-  return (BYTE*)new_ptr + CANARY_SIZE;
+  return (BYTE*)new_ptr + canary_size;
 }
 
 void* w_calloc(size_t count, size_t size, const char* file, const int line,
                const char* func) {
-  double start_time = w_get_time();
   w_check_initialization_internal();
-
-  pthread_mutex_lock(&w_mutex);
+  if (!W_HAS(TRACKING)) {
+    if (count && size > SIZE_MAX / count) {
+      w_log_error_internal(WATCHDOG_ERROR_CALLOC_OVERFLOW,
+                           WCS_intern(file, line, func));
+      return NULL;
+    }
+    return w_counted_alloc_internal(count * size, WCS_intern(file, line, func),
+                                    true);
+  }
+  // Overflowing requests go through the tracked path to be reported.
+  if (count && size && count <= SIZE_MAX / size &&
+      !w_sample_internal(count * size)) {
+    return w_unsampled_alloc_internal(count * size, true);
+  }
+  uint64_t start = w_ticks();
+  uint32_t site = WCS_intern(file, line, func);
 
   if (!count || !size) {
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
+    WLH_record(WLH_CALLOC, start);
     return NULL;
   }
 
-  if (count > (SIZE_MAX - 2 * CANARY_SIZE) / size) {
-    WATCHDOG_LOG_ERROR("Calloc parameter overflow.", file, line, func);
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
+  if (count > (SIZE_MAX - 2 * canary_size) / size) {
+    w_log_error_internal(WATCHDOG_ERROR_CALLOC_OVERFLOW, site);
+    WLH_record(WLH_CALLOC, start);
     return NULL;
   }
 
-  if (!w_alloc_max_size_check_internal(count * size, file, line, func)) {
-    w_stats.total_time_spent += (w_get_time() - start_time);
-    pthread_mutex_unlock(&w_mutex);
+  if (!w_alloc_max_size_check_internal(count * size, site)) {
+    WLH_record(WLH_CALLOC, start);
     return NULL;
   }
 
-  w_stats.total_allocations++;
-  w_stats.current_usage += count * size;
-  if (w_stats.current_usage > w_stats.peak_usage) {
-    w_stats.peak_usage = w_stats.current_usage;
-  }
-
-  void* ptr = malloc(count * size + (2 * CANARY_SIZE));
+  uint32_t stack = stack_depth ? WSD_capture(W_STACK_ANCHOR(func)) : WSD_NONE;
+  void* ptr = w_block_alloc_internal(count * size);
   w_alloc_check_internal(ptr, count * size, __FILE__, __LINE__, __func__);
-  WAM_alloc_create_internal(ptr, count * size, file, line, func);
-  memset((BYTE*)ptr, 0, count * size + (2 * CANARY_SIZE));
-  memset((BYTE*)ptr, CANARY_VALUE, CANARY_SIZE);
-  memset((BYTE*)ptr + (count * size) + CANARY_SIZE, CANARY_VALUE, CANARY_SIZE);
-
-  if (verbose_log) {
-    WATCHDOG_LOG("CALLOC", (void*)((BYTE*)ptr + CANARY_SIZE), count * size,
-                 file, line, func);
+  // Fresh mappings are already zeroed.
+  if (!w_guarded_internal(count * size)) {
+    memset((BYTE*)ptr + canary_size, 0, count * size);
   }
+  w_canary_fill_internal(ptr, count * size);
+  WAM_alloc_create_internal(ptr, count * size, site, stack);
+  w_stats_alloc_internal(count * size, site);
 
-  w_stats.total_time_spent += (w_get_time() - start_time);
-  pthread_mutex_unlock(&w_mutex);
+  if (w_verbose_internal()) {
+    w_log_event_internal(WATCHDOG_EVENT_CALLOC, (BYTE*)ptr + canary_size,
+                         count * size, site, w_get_time());
+  }
 
-  return (BYTE*)ptr + CANARY_SIZE;
+  WLH_record(WLH_CALLOC, start);
+  return (BYTE*)ptr + canary_size;
 }
 
 void w_free(void* ptr, const char* file, const int line, const char* func) {
-  double start_time = w_get_time();
   w_check_initialization_internal();
-  pthread_mutex_lock(&w_mutex);
+  if (!W_HAS(TRACKING)) {
+    if (ptr) {
+      w_counted_free_internal(ptr, WCS_intern(file, line, func));
+    }
+    return;
+  }
+  if (w_unsampled_internal(ptr)) {
+    w_unsampled_free_internal(ptr);
+    return;
+  }
+  uint64_t start = w_ticks();
+  w_free_internal(ptr, WCS_intern(file, line, func), start);
+}
 
-  for (int i = (int)watchdog.size - 1; i >= 0; i--) {
-    void* user_exposed_ptr = (BYTE*)watchdog.buffer[i]->ptr + CANARY_SIZE;
-
-    if (user_exposed_ptr == ptr) {
-      if (!watchdog.buffer[i]->freed) {
-        void* original_ptr = watchdog.buffer[i]->ptr;
-
-        // Canary Check
-        for (int j = 0; j < CANARY_SIZE; j++) {
-          if (((BYTE*)original_ptr)[j] != CANARY_VALUE ||
-              ((BYTE*)original_ptr + watchdog.buffer[i]->size +
-               CANARY_SIZE)[j] != CANARY_VALUE) {
-            WATCHDOG_LOG_ERROR("Out of bounds access.", file, line, func);
-            break;
-          }
-        }
+static void w_free_internal(void* ptr, const uint32_t site,
+                            const uint64_t start) {
+  void* original_ptr = (BYTE*)ptr - canary_size;
+  WS* shard = WS_for_internal(original_ptr);
+  WFR freed_record;
 
-        free(original_ptr);
-        watchdog.buffer[i]->freed = true;
+  w_shard_lock_internal(shard);
+  size_t index;
+  if (!WS_find(shard, original_ptr, &index)) {
+    // Quarantined blocks outlive their history entries; they are still
+    // freed, never foreign.
+    bool was_freed =
+        WFH_find(&shard->history, original_ptr, &freed_record) ||
+        WQ_find(&shard->quarantine, original_ptr, &freed_record);
+    pthread_mutex_unlock(&shard->mutex);
+    if (was_freed) {
+      w_freed_error_internal(WATCHDOG_ERROR_DOUBLE_FREE, &freed_record, site);
+    } else {
+#if WATCHDOG_PRELOAD
+      // Allocated before watchdog was loaded, or by libc on its behalf.
+      free(ptr);
+#else
+      // If we reach here, the pointer was never in our database.
+      w_log_error_internal(WATCHDOG_ERROR_UNTRACKED_FREE, site);
+#endif
+    }
+    WLH_record(WLH_FREE, start);
+    return;
+  }
+  WAM data = WAM_retire_internal(shard, index, site);
+  pthread_mutex_unlock(&shard->mutex);
 
-        if (verbose_log) {
-          WATCHDOG_LOG("FREE", ptr, watchdog.buffer[i]->size, file, line, func);
-        }
+  int64_t offset;
+  uint64_t phase = w_ticks();
+  bool intact = w_canary_intact_internal(original_ptr, data.size, &offset);
+  WLH_record(WLH_CANARY, phase);
+  if (!intact) {
+    w_log_bounds_error_internal(ptr, data.size, offset, site);
+  }
 
-        w_stats.current_usage -= watchdog.buffer[i]->size;
-        w_stats.total_frees++;
-        w_stats.total_time_spent += (w_get_time() - start_time);
-        pthread_mutex_unlock(&w_mutex);
-        return;
-      } else {
-        WATCHDOG_LOG_ERROR("Double free error.", file, line, func);
-        w_stats.total_time_spent += (w_get_time() - start_time);
-        pthread_mutex_unlock(&w_mutex);
-        return;
-      }
-    }
+  w_lifetime_record_internal(&data);
+  if (quarantine_bytes) {
+    w_quarantine_internal(shard, &data, site);
+  } else {
+    w_release_block_internal(original_ptr, data.size);
   }
 
-  // If we reach here, the pointer was never in our database.
-  WATCHDOG_LOG_ERROR("Attempt to free unallocated/untracked memory.", file,
-                     line, func);
-  w_stats.total_time_spent += (w_get_time() - start_time);
-  pthread_mutex_unlock(&w_mutex);
+  if (w_verbose_internal()) {
+    w_log_event_internal(WATCHDOG_EVENT_FREE, ptr, data.size, site,
+                         w_get_time());
+  }
+
+  w_stats_free_internal(data.size, data.site);
+  WLH_record(WLH_FREE, start);
 }
 
 static void w_alloc_check_internal(void* ptr, const size_t size,
@@ -372,168 +1480,3005 @@ static void w_alloc_check_internal(void* ptr, const size_t size,
             "[%s:%u:(%s)] Memory allocation error. Failed to allocate %lu "
             "bytes to memory address %p.\n",
             file, line, func, size, (void*)ptr);
-    pthread_mutex_unlock(&w_mutex);
     exit(EXIT_FAILURE);
   }
 }
 
-static bool w_alloc_max_size_check_internal(const size_t size, const char* file,
-                                            const int line, const char* func) {
-  if (size > SIZE_MAX - 2 * CANARY_SIZE) {
-    WATCHDOG_LOG_ERROR("Out of memory error.", file, line, func);
+static bool w_alloc_max_size_check_internal(const size_t size,
+                                            const uint32_t site) {
+  // Guarded blocks are also rounded up to whole pages, plus the guard page.
+  size_t overhead = 2 * canary_size + 2 * w_page_size;
+  if (size > SIZE_MAX - overhead) {
+    w_log_error_internal(WATCHDOG_ERROR_OUT_OF_MEMORY, site);
     return false;
   }
   return true;
 }
 
-static void WAM_alloc_create_internal(void* ptr, const size_t size,
-                                      const char* file, const int line,
-                                      const char* func) {
-  WAM* data = malloc(sizeof *data);
-  w_alloc_check_internal(data, sizeof *data, __FILE__, __LINE__, __func__);
+static void w_canary_fill_internal(void* original_ptr, const size_t size) {
+  if (!W_HAS(CANARIES)) {
+    return;
+  }
+  uint64_t start = w_ticks();
+  memset(original_ptr, CANARY_VALUE, canary_size);
+  memset((BYTE*)original_ptr + canary_size + size, CANARY_VALUE,
+         w_trailer_size_internal(size));
+  WLH_record(WLH_CANARY, start);
+}
 
-#if WATCHDOG_COPY_STRINGS
-  file = file ? strdup(file) : NULL;
-  func = func ? strdup(func) : NULL;
+// Returns the offset of the first byte in `zone` that no longer holds
+// `value` (CANARY_VALUE, or the quarantine poison), or `length` if the whole
+// zone is intact. Intact zones are compared a vector or a word at a time;
+// bytes are only examined to locate the damage.
+static size_t w_canary_scan_internal(const BYTE* zone, const size_t length,
+                                     const BYTE value) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i expected256 = _mm256_set1_epi8((char)value);
+  for (; i + 32 <= length; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(zone + i));
+    uint32_t equal =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, expected256));
+    if (equal != UINT32_MAX) {
+      return i + (size_t)__builtin_ctz(~equal);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i expected128 = _mm_set1_epi8((char)value);
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(zone + i));
+    uint32_t equal =
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, expected128));
+    if (equal != 0xFFFF) {
+      return i + (size_t)__builtin_ctz(~equal);
+    }
+  }
 #endif
+  const uint64_t expected64 = 0x0101010101010101ULL * value;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, zone + i, sizeof word);
+    if (word != expected64) {
+      break;
+    }
+  }
+  for (; i < length; i++) {
+    if (zone[i] != value) {
+      return i;
+    }
+  }
+  return length;
+}
 
-  data->ptr = ptr;
-  data->size = size;
-  data->file = file;
-  data->line = line;
-  data->func = func;
-  data->freed = false;
+// Checks both guard zones of a block. On damage, `offset` receives the
+// position of the first overwritten byte relative to the user pointer:
+// negative in the leading zone, `size` or more in the trailing one.
+static bool w_canary_intact_internal(const void* original_ptr,
+                                     const size_t size, int64_t* offset) {
+  if (!W_HAS(CANARIES)) {
+    return true;
+  }
+  const BYTE* block = original_ptr;
+#if WATCHDOG_INLINE_HEADER
+  // An underflow that reaches the header is reported like any other.
+  const WBH* header = original_ptr;
+  if (header->check != WBH_check_internal(original_ptr, size) ||
+      header->size != size) {
+    *offset = -(int64_t)canary_size;
+    return false;
+  }
+#endif
+  size_t prefix = canary_size - CANARY_PREFIX_START;
+  size_t damaged = w_canary_scan_internal(block + CANARY_PREFIX_START, prefix,
+                                          CANARY_VALUE);
+  if (damaged != prefix) {
+    *offset = (int64_t)damaged - (int64_t)prefix;
+    return false;
+  }
+  size_t trailer = w_trailer_size_internal(size);
+  damaged =
+      w_canary_scan_internal(block + canary_size + size, trailer, CANARY_VALUE);
+  if (damaged != trailer) {
+    *offset = (int64_t)(size + damaged);
+    return false;
+  }
+  return true;
+}
 
-  WDA_push(data);
-  return;
+// Returns a retired block to this thread's cache, to the system allocator,
+// or unmaps it.
+static void w_release_block_internal(void* original_ptr, const size_t size) {
+#if WATCHDOG_INLINE_HEADER
+  // A later free of the same pointer must not find a valid header.
+  ((WBH*)original_ptr)->check = 0;
+#endif
+  if (thread_cache_bytes && !w_guarded_internal(size) &&
+      w_cache_put_internal(original_ptr, w_block_span_internal(size))) {
+    return;
+  }
+  uint64_t start = w_ticks();
+  if (w_guarded_internal(size)) {
+    // Leaks released at exit were never retired.
+    WGB_remove(original_ptr, size);
+    w_unmap_guarded_internal(original_ptr, size);
+  } else {
+    free(original_ptr);
+  }
+  WLH_record(WLH_SYSTEM_ALLOCATOR, start);
 }
 
-static void WAM_realloc_update_internal(void* old_ptr, void* new_ptr,
-                                        const size_t new_size, const char* file,
-                                        const int line, const char* func) {
-  void* original_ptr = (BYTE*)old_ptr - CANARY_SIZE;
-  for (size_t i = 0; i < watchdog.size; i++) {
-    if (watchdog.buffer[i]->ptr == original_ptr && !watchdog.buffer[i]->freed) {
-      // Canary check on the old allocation before freeing it.
-      for (int j = 0; j < CANARY_SIZE; j++) {
-        if (((BYTE*)original_ptr)[j] != CANARY_VALUE ||
-            ((BYTE*)original_ptr + watchdog.buffer[i]->size +
-             CANARY_SIZE)[j] != CANARY_VALUE) {
-          WATCHDOG_LOG_ERROR("Out of bounds access.", file, line, func);
-          break;
-        }
-      }
-      if (verbose_log) {
-        WATCHDOG_LOG("FREE", old_ptr, watchdog.buffer[i]->size,
-                     watchdog.buffer[i]->file, watchdog.buffer[i]->line,
-                     watchdog.buffer[i]->func);
-      }
-      free(original_ptr);
-      watchdog.buffer[i]->freed = true;
-      w_stats.current_usage -= watchdog.buffer[i]->size;
-      w_stats.total_frees++;
-      break;
+// Returns the start of a new block with room for both guards, or NULL. Blocks
+// of at least `guard_page_threshold` bytes get their own mapping, placed so
+// their data ends (rounded up to CANARY_ALIGNMENT) right at an inaccessible
+// page.
+static void* w_block_alloc_internal(const size_t size) {
+  if (thread_cache_bytes && !w_guarded_internal(size)) {
+    void* cached = w_cache_take_internal(w_block_span_internal(size));
+    if (cached) {
+      return cached;
+    }
+  }
+  uint64_t start = w_ticks();
+  void* ptr;
+  if (w_guarded_internal(size)) {
+    size_t span = w_guarded_span_internal(size);
+    BYTE* base = mmap(NULL, span + w_page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      ptr = NULL;
+    } else {
+      mprotect(base + span, w_page_size, PROT_NONE);
+      ptr = base + span - w_trailer_size_internal(size) - size - canary_size;
     }
+  } else {
+    ptr = malloc(w_block_span_internal(size));
   }
+  WLH_record(WLH_SYSTEM_ALLOCATOR, start);
+  return ptr;
+}
 
-  WAM_alloc_create_internal(new_ptr, new_size, file, line, func);
+// Bytes asked of the system allocator for a block: the data and both guards,
+// rounded up to the cache class while the cache is on, so that every block
+// of a class can serve any request of that class.
+static size_t w_block_span_internal(const size_t size) {
+  size_t span = size + (2 * canary_size);
+  if (thread_cache_bytes && span <= WATCHDOG_CACHE_MAX_BLOCK) {
+    span = (span + WTC_CLASS_SIZE - 1) & ~(size_t)(WTC_CLASS_SIZE - 1);
+  }
+  return span;
 }
 
-static void w_check_initialization_internal(void) {
-  pthread_mutex_lock(&w_mutex);
-  bool needs_init = !w_initialized;
-  pthread_mutex_unlock(&w_mutex);
-  if (needs_init) {
-    w_init(true, false, false);
+// Pops a block of `span` bytes from this thread's cache, or returns NULL.
+// The caller stamps the guards again, as for a fresh block.
+static void* w_cache_take_internal(const size_t span) {
+  if (span > WATCHDOG_CACHE_MAX_BLOCK) {
+    return NULL;
   }
+  WTC* cache = &w_cache;
+  void** head = &cache->heads[span / WTC_CLASS_SIZE - 1];
+  void* block = *head;
+  if (block) {
+    memcpy(head, block, sizeof *head);
+    cache->bytes -= span;
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  if (cache->hits + cache->misses >= WTC_FOLD_INTERVAL) {
+    w_cache_fold_internal(cache);
+  }
+  return block;
 }
 
-static void w_report(void) {
-  verbose_log = false;
-  for (size_t i = 0; i < watchdog.size; i++) {
-    if (!watchdog.buffer[i]->freed) {
-      WATCHDOG_LOG("LEAK",
-                   (void*)((BYTE*)watchdog.buffer[i]->ptr + CANARY_SIZE),
-                   watchdog.buffer[i]->size, watchdog.buffer[i]->file,
-                   watchdog.buffer[i]->line, watchdog.buffer[i]->func);
-      w_free((BYTE*)watchdog.buffer[i]->ptr + CANARY_SIZE,
-             watchdog.buffer[i]->file, watchdog.buffer[i]->line,
-             watchdog.buffer[i]->func);
+// Keeps a retired block of `span` bytes for reuse by this thread, unless it
+// is too large or the cache is full.
+static bool w_cache_put_internal(void* block, const size_t span) {
+  WTC* cache = &w_cache;
+  if (span > WATCHDOG_CACHE_MAX_BLOCK ||
+      cache->bytes + span > thread_cache_bytes) {
+    return false;
+  }
+  if (!cache->registered) {
+    // The value only needs to be non-NULL for the destructor to run.
+    if (pthread_setspecific(w_cache_key, cache) != 0) {
+      return false;
     }
+    cache->registered = true;
   }
+  void** head = &cache->heads[span / WTC_CLASS_SIZE - 1];
+  memcpy(block, head, sizeof *head);
+  *head = block;
+  cache->bytes += span;
+  return true;
+}
 
-  fprintf(w_log_file, "\n---Watchdog Report---\n");
-  fprintf(w_log_file, "Total Allocations:  %zu\n", w_stats.total_allocations);
-  fprintf(w_log_file, "Total Frees:        %zu\n", w_stats.total_frees);
-  fprintf(w_log_file, "Peak Memory Usage:  %zu Bytes (%.2f MB)\n",
-          w_stats.peak_usage, w_stats.peak_usage / 1024.0 / 1024.0);
-  fprintf(w_log_file, "Total Tool Latency: %.6f seconds\n",
-          w_stats.total_time_spent);
-  fprintf(w_log_file, "Avg Latency/Alloc:  %.6f ms\n",
-          (w_stats.total_allocations > 0)
-              ? (w_stats.total_time_spent / w_stats.total_allocations) * 1000
-              : 0);
-  fprintf(w_log_file, "\n");
+static void w_cache_fold_internal(WTC* cache) {
+  atomic_fetch_add_explicit(&w_cache_hits, cache->hits, memory_order_relaxed);
+  atomic_fetch_add_explicit(&w_cache_misses, cache->misses,
+                            memory_order_relaxed);
+  cache->hits = 0;
+  cache->misses = 0;
+}
+
+// Returns every cached block to the system allocator. Runs on thread exit
+// and once more for the thread that finalizes watchdog.
+static void w_cache_flush_internal(void* arg) {
+  WTC* cache = arg;
+  w_reentry++;
+  for (size_t i = 0; i < WTC_CLASSES; i++) {
+    while (cache->heads[i]) {
+      void* block = cache->heads[i];
+      memcpy(&cache->heads[i], block, sizeof cache->heads[i]);
+      free(block);
+    }
+  }
+  cache->bytes = 0;
+  cache->registered = false;
+  w_cache_fold_internal(cache);
+  w_reentry--;
+}
+
+static bool w_guarded_internal(const size_t size) {
+  return guard_page_threshold && size >= guard_page_threshold;
+}
+
+// Accessible bytes of a guarded block's mapping, in front of the guard page.
+static size_t w_guarded_span_internal(const size_t size) {
+  size_t span = canary_size + size + w_trailer_size_internal(size);
+  return (span + w_page_size - 1) & ~(w_page_size - 1);
+}
+
+// Length of the guard zone behind a block's data. A guarded block keeps only
+// the padding that aligns its end; the guard page does the rest.
+static size_t w_trailer_size_internal(const size_t size) {
+  if (w_guarded_internal(size)) {
+    return (CANARY_ALIGNMENT - size % CANARY_ALIGNMENT) % CANARY_ALIGNMENT;
+  }
+  return canary_size;
 }
 
-static void WDA_push(void* ptr) {
-  if (watchdog.size == watchdog.capacity) {
-    WDA_expand_capacity_internal();
+// SIGSEGV handler. A fault in the guard page of a live block is reported with
+// the block's allocation site; the previous disposition is then restored and
+// the access retried, so the process still dies (or the program's own
+// handler runs) as it would have. Only async-signal-safe work happens here:
+// a lock-free lookup, hand-rolled formatting and one write(2).
+static void w_guard_fault_internal(int signal, siginfo_t* info,
+                                   void* context) {
+  (void)context;
+  uintptr_t address = (uintptr_t)info->si_addr;
+  const WGB* entry = WGB_find(address & ~(uintptr_t)(w_page_size - 1));
+  if (entry) {
+    const WCS* site = &w_call_sites[entry->site];
+    char line[WATCHDOG_ERROR_TEXT_SIZE + 256];
+    size_t length = 0;
+    w_signal_append_internal(line, &length, sizeof line, "[ERROR] [");
+    w_signal_append_internal(line, &length, sizeof line,
+                             site->file ? site->file : "??");
+    w_signal_append_internal(line, &length, sizeof line, ":");
+    w_signal_append_number_internal(line, &length, sizeof line, site->line,
+                                    10);
+    w_signal_append_internal(line, &length, sizeof line, " (");
+    w_signal_append_internal(line, &length, sizeof line,
+                             site->func ? site->func : "??");
+    w_signal_append_internal(line, &length, sizeof line, ")]: ");
+    w_signal_append_internal(
+        line, &length, sizeof line,
+        watchdog_error_message(WATCHDOG_ERROR_GUARD_PAGE));
+    w_signal_append_internal(line, &length, sizeof line, " Overflow of 0x");
+    w_signal_append_number_internal(line, &length, sizeof line,
+                                    entry->user_ptr, 16);
+    w_signal_append_internal(line, &length, sizeof line,
+                             ": faulting access at end+");
+    w_signal_append_number_internal(line, &length, sizeof line,
+                                    address - entry->user_ptr - entry->size,
+                                    10);
+    w_signal_append_internal(line, &length, sizeof line, ".\n");
+    ssize_t written = write(STDERR_FILENO, line, length);
+    (void)written;
   }
-  watchdog.buffer[watchdog.size++] = ptr;
+  sigaction(signal, &w_previous_segv, NULL);
+}
+
+// First byte of the inaccessible page behind a guarded block.
+static uintptr_t w_guard_page_internal(const void* original_ptr,
+                                       const size_t size) {
+  return (uintptr_t)original_ptr + canary_size + size +
+         w_trailer_size_internal(size);
 }
 
-static void WDA_pop(void) {
-  if (!(watchdog.size > 0)) {
+static void w_unmap_guarded_internal(const void* original_ptr,
+                                     const size_t size) {
+  uintptr_t base = (uintptr_t)original_ptr & ~(uintptr_t)(w_page_size - 1);
+  size_t length = w_guarded_span_internal(size) + w_page_size;
+#if WATCHDOG_INLINE_HEADER
+  // The header starts in the first page and may run into the second; a
+  // mapping always has both. MAP_FIXED swaps them in place, so the range is
+  // never free for another mapping in between.
+  size_t kept = 2 * w_page_size;
+  if (mmap((void*)base, kept, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+    munmap((void*)(base + kept), length - kept);
+    pthread_mutex_lock(&w_retired_mutex);
+    uintptr_t oldest = w_retired_guarded[w_retired_next];
+    w_retired_guarded[w_retired_next] = base;
+    w_retired_next = (w_retired_next + 1) % WATCHDOG_MAX_GUARDED_BLOCKS;
+    pthread_mutex_unlock(&w_retired_mutex);
+    if (oldest) {
+      munmap((void*)oldest, kept);
+    }
     return;
   }
-  watchdog.size--;
-#if WATCHDOG_COPY_STRINGS
-  if (watchdog.buffer[watchdog.size]) {
-    free(watchdog.buffer[watchdog.size]->file);
-    free(watchdog.buffer[watchdog.size]->func);
+#endif
+  munmap((void*)base, length);
+}
+
+static size_t WGB_slot_internal(const uintptr_t guard) {
+  uint64_t key = (uint64_t)(guard / w_page_size) * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(key >> 32) & (WATCHDOG_MAX_GUARDED_BLOCKS - 1);
+}
+
+static void WGB_insert(const void* original_ptr, const size_t size,
+                       const uint32_t site) {
+  uintptr_t guard = w_guard_page_internal(original_ptr, size);
+  size_t mask = WATCHDOG_MAX_GUARDED_BLOCKS - 1;
+  size_t i = WGB_slot_internal(guard);
+  for (size_t probes = 0; probes < WATCHDOG_MAX_GUARDED_BLOCKS;
+       probes++, i = (i + 1) & mask) {
+    WGB* entry = &w_guarded_blocks[i];
+    uintptr_t current =
+        atomic_load_explicit(&entry->guard, memory_order_relaxed);
+    if ((current != WGB_EMPTY && current != WGB_REMOVED) ||
+        !atomic_compare_exchange_strong_explicit(
+            &entry->guard, &current, WGB_BUSY, memory_order_acquire,
+            memory_order_relaxed)) {
+      continue;
+    }
+    entry->user_ptr = (uintptr_t)original_ptr + canary_size;
+    entry->size = size;
+    entry->site = site;
+    atomic_store_explicit(&entry->guard, guard, memory_order_release);
+    return;
+  }
+}
+
+static void WGB_remove(const void* original_ptr, const size_t size) {
+  WGB* entry = (WGB*)WGB_find(w_guard_page_internal(original_ptr, size));
+  if (entry) {
+    atomic_store_explicit(&entry->guard, WGB_REMOVED, memory_order_release);
+  }
+}
+
+// Returns the live guarded block whose guard page starts at `guard`, or
+// NULL. Async-signal-safe.
+static const WGB* WGB_find(const uintptr_t guard) {
+  size_t mask = WATCHDOG_MAX_GUARDED_BLOCKS - 1;
+  size_t i = WGB_slot_internal(guard);
+  for (size_t probes = 0; probes < WATCHDOG_MAX_GUARDED_BLOCKS;
+       probes++, i = (i + 1) & mask) {
+    const WGB* entry = &w_guarded_blocks[i];
+    uintptr_t current =
+        atomic_load_explicit(&entry->guard, memory_order_acquire);
+    if (current == guard) {
+      return entry;
+    }
+    if (current == WGB_EMPTY) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Formatting for the fault handler, which cannot use stdio. Output past
+// `capacity` - 1 bytes is cut off.
+static void w_signal_append_internal(char* buffer, size_t* length,
+                                     const size_t capacity, const char* text) {
+  while (*text && *length + 1 < capacity) {
+    buffer[(*length)++] = *text++;
   }
+}
+
+static void w_signal_append_number_internal(char* buffer, size_t* length,
+                                            const size_t capacity,
+                                            uint64_t value,
+                                            const unsigned int base) {
+  char digits[24];
+  size_t count = 0;
+  do {
+    digits[count++] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  while (count && *length + 1 < capacity) {
+    buffer[(*length)++] = digits[--count];
+  }
+}
+
+// Poisons a retired block and parks it in its shard's quarantine, releasing
+// the oldest blocks beyond the shard's share of the budget. Blocks larger
+// than the share are released at once.
+static void w_quarantine_internal(WS* shard, const WAM* data,
+                                  const uint32_t free_site) {
+  size_t budget = quarantine_bytes / WATCHDOG_SHARDS;
+  if (data->size > budget) {
+    w_release_block_internal(data->ptr, data->size);
+    return;
+  }
+  uint64_t start = w_ticks();
+  memset((BYTE*)data->ptr + canary_size, quarantine_poison, data->size);
+  WLH_record(WLH_CANARY, start);
+#if WATCHDOG_INLINE_HEADER
+  ((WBH*)data->ptr)->check = 0;
 #endif
-  free(watchdog.buffer[watchdog.size]);
-  watchdog.buffer[watchdog.size] = NULL;
+  w_shard_lock_internal(shard);
+  WQ_push(&shard->quarantine, data, free_site);
+  pthread_mutex_unlock(&shard->mutex);
+  w_quarantine_evict_internal(shard, budget);
 }
 
-static void WDA_cleanup(void) {
-  if (watchdog.buffer) {
-    while (watchdog.size > 0) {
-      WDA_pop();
+// Releases the oldest quarantined blocks of a shard until it holds at most
+// `budget` bytes. Poison is verified outside the shard lock.
+static void w_quarantine_evict_internal(WS* shard, const size_t budget) {
+  for (;;) {
+    w_shard_lock_internal(shard);
+    if (shard->quarantine.bytes <= budget) {
+      pthread_mutex_unlock(&shard->mutex);
+      return;
     }
-    free(watchdog.buffer);
-    watchdog.buffer = NULL;
+    WFR record = WQ_pop(&shard->quarantine);
+    pthread_mutex_unlock(&shard->mutex);
+    w_quarantine_release_internal(&record);
   }
-  watchdog.size = 0;
-  watchdog.capacity = 0;
 }
 
-static void WDA_expand_capacity_internal(void) {
-  watchdog.capacity *= WDA_GROWTH_FACTOR;
-  WAM** buffer =
-      realloc(watchdog.buffer, sizeof *watchdog.buffer * watchdog.capacity);
-  w_alloc_check_internal(buffer, sizeof *watchdog.buffer * watchdog.capacity,
-                         __FILE__, __LINE__, __func__);
-  watchdog.buffer = buffer;
+static void w_quarantine_release_internal(const WFR* record) {
+  if (quarantine_verify) {
+    BYTE* user_ptr = (BYTE*)record->data.ptr + canary_size;
+    uint64_t start = w_ticks();
+    size_t damaged = w_canary_scan_internal(user_ptr, record->data.size,
+                                            quarantine_poison);
+    WLH_record(WLH_CANARY, start);
+    if (damaged != record->data.size) {
+      WEV event = {
+          .timestamp = w_get_time(),
+          .ptr = (uint64_t)(uintptr_t)user_ptr,
+          .size = WATCHDOG_ERROR_USE_AFTER_FREE,
+          .aux = damaged,
+          .site = record->free_site,
+          .thread = w_thread_id_internal(),
+          .op = WATCHDOG_EVENT_ERROR,
+      };
+      w_log_dispatch_internal(&event);
+      w_log_event_internal(WATCHDOG_EVENT_ALLOCATED, user_ptr,
+                           record->data.size, record->data.site,
+                           event.timestamp);
+      w_log_event_internal(WATCHDOG_EVENT_FREED, user_ptr, record->data.size,
+                           record->free_site, event.timestamp);
+    }
+  }
+  w_release_block_internal(record->data.ptr, record->data.size);
 }
 
-static void w_configure_log_destination_internal(bool enable_file_log) {
-  if (w_log_file && w_log_file != stdout) {
-    fclose(w_log_file);
-    w_log_file = NULL;
+static void w_note_block_internal(const void* ptr) {
+  uintptr_t address = (uintptr_t)ptr;
+  uintptr_t bound = atomic_load_explicit(&w_block_min, memory_order_relaxed);
+  while (address < bound && !atomic_compare_exchange_weak_explicit(
+                                &w_block_min, &bound, address,
+                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+  bound = atomic_load_explicit(&w_block_max, memory_order_relaxed);
+  while (address > bound && !atomic_compare_exchange_weak_explicit(
+                                &w_block_max, &bound, address,
+                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+// A guarded block (or any mapping) can start right at ptr, so a prefix that
+// reaches back into the previous page is read only once that page is known
+// to be readable: the probe copy fails instead of faulting on unmapped or
+// PROT_NONE pages. Where the syscall is refused, fall back to mincore and
+// watchdog's own guard pages.
+static bool w_prefix_mapped_internal(const void* ptr, const size_t bytes) {
+  uintptr_t address = (uintptr_t)ptr;
+  if (address % w_page_size >= bytes) {
+    return true;
   }
+  int saved_errno = errno;
+  unsigned char byte;
+  struct iovec local = {&byte, 1};
+  struct iovec remote = {(void*)(address - bytes), 1};
+  bool readable = process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 1;
+  if (!readable && errno != EFAULT) {
+    uintptr_t page = (address - bytes) & ~(uintptr_t)(w_page_size - 1);
+    unsigned char resident;
+    readable = mincore((void*)page, 1, &resident) == 0 && !WGB_find(page);
+  }
+  errno = saved_errno;
+  return readable;
+}
 
-  log_to_file = enable_file_log;
-  if (log_to_file) {
-    w_log_file = fopen(log_file_name, "a");
-    if (!w_log_file) {
-      fprintf(stderr, "Failed to open log file: %s\n", log_file_name);
-      pthread_mutex_unlock(&w_mutex);
-      exit(EXIT_FAILURE);
+// Byte-driven sampling as in tcmalloc: each thread counts down the bytes it
+// allocates and fully tracks the allocation that crosses zero. Returns true
+// for allocations that must be tracked.
+static bool w_sample_internal(const size_t size) {
+  if (!sample_rate) {
+    return true;
+  }
+  if (!w_sample_seed) {
+    w_sample_seed = (w_get_time() ^ (uint64_t)w_thread_id_internal() << 32) |
+                    1;
+    w_sample_countdown = w_sample_interval_internal();
+  }
+  if (size < w_sample_countdown) {
+    w_sample_countdown -= size;
+    return false;
+  }
+  w_sample_countdown = w_sample_interval_internal();
+  return true;
+}
+
+// Draws the next interval from an exponential distribution with mean
+// `sample_rate`, so sampling is memoryless and periodic allocation patterns
+// cannot line up with it. -ln(u) is computed without libm: split u into
+// 2^e * m and sum the atanh series for ln(m), m in [1, 2).
+static size_t w_sample_interval_internal(void) {
+  w_sample_seed ^= w_sample_seed << 13;
+  w_sample_seed ^= w_sample_seed >> 7;
+  w_sample_seed ^= w_sample_seed << 17;
+  double u = (double)((w_sample_seed >> 11) + 1) * 0x1p-53;  // (0, 1]
+
+  uint64_t bits;
+  memcpy(&bits, &u, sizeof bits);
+  int exponent = (int)((bits >> 52) & 0x7FF) - 1023;
+  bits = (bits & 0xFFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+  double m;
+  memcpy(&m, &bits, sizeof m);
+  double t = (m - 1) / (m + 1);
+  double t2 = t * t;
+  double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+  double ln_u = exponent * 0.6931471805599453 + ln_m;
+
+  return (size_t)(-ln_u * (double)sample_rate) + 1;
+}
+
+// Bytes a sampled allocation of `size` stands for. It was sampled with
+// probability 1 - e^(-size / sample_rate), so it is scaled by the inverse.
+static double w_sample_weight_internal(const size_t size) {
+  double x = (double)size / (double)sample_rate;
+  if (x > 40) {
+    return (double)size;
+  }
+  // e^-x = 2^-k * e^-r with r in [0, ln 2), r by its Taylor series.
+  int k = (int)(x * 1.4426950408889634);
+  double r = x - k * 0.6931471805599453;
+  double e = 1;
+  for (int n = 6; n > 0; n--) {
+    e = 1 - r / n * e;
+  }
+  e /= (double)(1ULL << k);
+  return (double)size / (1 - e);
+}
+
+static void* w_unsampled_alloc_internal(const size_t size, const bool zero) {
+  if (size > SIZE_MAX - sizeof(WUT)) {
+    return NULL;
+  }
+  WUT* tag = zero ? calloc(1, sizeof *tag + size) : malloc(sizeof *tag + size);
+  if (!tag) {
+    return NULL;
+  }
+  w_note_block_internal(tag);
+  tag->tag = WUT_MAGIC ^ (uint64_t)(uintptr_t)tag;
+  return tag + 1;
+}
+
+// Only aligned pointers inside the range of handed-out blocks, whose tag
+// would lie in mapped memory, are read.
+static bool w_unsampled_internal(const void* ptr) {
+  if (!sample_rate) {
+    return false;
+  }
+  uintptr_t address = (uintptr_t)ptr - sizeof(WUT);
+  if ((uintptr_t)ptr % _Alignof(WUT) ||
+      address < atomic_load_explicit(&w_block_min, memory_order_relaxed) ||
+      address > atomic_load_explicit(&w_block_max, memory_order_relaxed) ||
+      !w_prefix_mapped_internal(ptr, sizeof(WUT))) {
+    return false;
+  }
+  const WUT* tag = (const WUT*)ptr - 1;
+  return tag->tag == (WUT_MAGIC ^ (uint64_t)address);
+}
+
+static void w_unsampled_free_internal(void* ptr) {
+  WUT* tag = (WUT*)ptr - 1;
+  tag->tag = 0;
+  free(tag);
+}
+
+static void* w_unsampled_realloc_internal(void* ptr, const size_t size) {
+  if (!size) {
+    w_unsampled_free_internal(ptr);
+    return NULL;
+  }
+  if (size > SIZE_MAX - sizeof(WUT)) {
+    return NULL;
+  }
+  WUT* tag = realloc((WUT*)ptr - 1, sizeof *tag + size);
+  if (!tag) {
+    return NULL;
+  }
+  w_note_block_internal(tag);
+  tag->tag = WUT_MAGIC ^ (uint64_t)(uintptr_t)tag;
+  return tag + 1;
+}
+
+// Counts a new block when tracking is compiled out. The header in front of it
+// remembers the size and site so the free can be counted against them.
+static void* w_counted_alloc_internal(const size_t size, const uint32_t site,
+                                      const bool zero) {
+  if (!w_alloc_max_size_check_internal(size, site) || !size) {
+    return NULL;
+  }
+  WCH* header =
+      zero ? calloc(1, sizeof *header + size) : malloc(sizeof *header + size);
+  w_alloc_check_internal(header, size, __FILE__, __LINE__, __func__);
+  w_note_block_internal(header);
+  header->size = size;
+  header->site = site;
+  header->check = WCH_MAGIC ^ (uint32_t)(uintptr_t)header;
+  w_stats_alloc_internal(size, site);
+  return header + 1;
+}
+
+// Returns the header of a counted block, or NULL for pointers watchdog did
+// not hand out (or already took back).
+static WCH* w_counted_header_internal(const void* ptr) {
+  uintptr_t address = (uintptr_t)ptr - sizeof(WCH);
+  if ((uintptr_t)ptr % _Alignof(WCH) ||
+      address < atomic_load_explicit(&w_block_min, memory_order_relaxed) ||
+      address > atomic_load_explicit(&w_block_max, memory_order_relaxed) ||
+      !w_prefix_mapped_internal(ptr, sizeof(WCH))) {
+    return NULL;
+  }
+  WCH* header = (WCH*)ptr - 1;
+  return header->check == (WCH_MAGIC ^ (uint32_t)address) ? header : NULL;
+}
+
+static void w_counted_free_internal(void* ptr, const uint32_t site) {
+  WCH* header = w_counted_header_internal(ptr);
+  if (!header) {
+#if WATCHDOG_PRELOAD
+    // Allocated before watchdog was loaded, or by libc on its behalf.
+    (void)site;
+    free(ptr);
+#else
+    w_log_error_internal(WATCHDOG_ERROR_UNTRACKED_FREE, site);
+#endif
+    return;
+  }
+  header->check = 0;
+  w_stats_free_internal(header->size, header->site);
+  free(header);
+}
+
+static void* w_counted_realloc_internal(void* ptr, const size_t size,
+                                        const uint32_t site) {
+  WCH* header = w_counted_header_internal(ptr);
+  if (!header) {
+#if WATCHDOG_PRELOAD
+    return realloc(ptr, size);
+#else
+    w_log_error_internal(WATCHDOG_ERROR_UNTRACKED_REALLOC, site);
+    return NULL;
+#endif
+  }
+  if (!size) {
+    w_counted_free_internal(ptr, site);
+    return NULL;
+  }
+  if (!w_alloc_max_size_check_internal(size, site)) {
+    return NULL;
+  }
+  size_t old_size = header->size;
+  uint32_t old_site = header->site;
+  header->check = 0;
+  header = realloc(header, sizeof *header + size);
+  w_alloc_check_internal(header, size, __FILE__, __LINE__, __func__);
+  w_note_block_internal(header);
+  header->size = size;
+  header->site = site;
+  header->check = WCH_MAGIC ^ (uint32_t)(uintptr_t)header;
+  w_stats_free_internal(old_size, old_site);
+  w_stats_alloc_internal(size, site);
+  return header + 1;
+}
+
+static void WAM_alloc_create_internal(void* ptr, const size_t size,
+                                      const uint32_t site,
+                                      const uint32_t stack) {
+  WAM data = {.ptr = ptr, .size = size, .site = site, .stack = stack};
+  w_lifetime_stamp_internal(&data);
+
+  WS* shard = WS_for_internal(ptr);
+  w_shard_lock_internal(shard);
+  WS_insert(shard, &data);
+  pthread_mutex_unlock(&shard->mutex);
+  if (w_guarded_internal(size)) {
+    WGB_insert(ptr, size, site);
+  }
+}
+
+// Removes a live record from its shard, remembers it in the shard's freed
+// history and returns a copy of it. The caller must hold the shard lock.
+static WAM WAM_retire_internal(WS* shard, const size_t index,
+                               const uint32_t site) {
+  WAM data = shard->records.buffer[index];
+  WS_remove(shard, index);
+  WFH_push(&shard->history, &data, site);
+  if (w_guarded_internal(data.size)) {
+    WGB_remove(data.ptr, data.size);
+  }
+  return data;
+}
+
+static void w_lifetime_stamp_internal(WAM* data) {
+  if (!lifetime_profile) {
+    data->born = 0;
+    return;
+  }
+  data->born = w_get_time();
+  data->sequence = (uint32_t)atomic_load_explicit(&w_stats.total_allocations,
+                                                  memory_order_relaxed);
+}
+
+// Charges a freed block's lifetime to the site that allocated it. A block is
+// short-lived if it dies within `short_lived_ns` or within
+// `short_lived_allocations` allocations by the whole process.
+static void w_lifetime_record_internal(const WAM* data) {
+  if (!data->born) {
+    return;
+  }
+  uint64_t lifetime = w_get_time() - data->born;
+  uint32_t allocations = (uint32_t)atomic_load_explicit(
+                             &w_stats.total_allocations, memory_order_relaxed) -
+                         data->sequence;
+  WLT* lifetimes = &w_lifetimes[data->site];
+  size_t bucket = 0;
+  for (uint64_t bound = 1000; bucket < WLT_BUCKETS - 1 && lifetime >= bound;
+       bound *= 10) {
+    bucket++;
+  }
+  atomic_fetch_add_explicit(&lifetimes->buckets[bucket], 1,
+                            memory_order_relaxed);
+  if (lifetime < short_lived_ns || allocations <= short_lived_allocations) {
+    atomic_fetch_add_explicit(&lifetimes->short_lived, 1,
+                              memory_order_relaxed);
+  }
+}
+
+static void w_freed_error_internal(const WatchdogError error,
+                                   const WFR* record, const uint32_t site) {
+  w_log_error_internal(error, site);
+  uint64_t now = w_get_time();
+  void* user_ptr = (BYTE*)record->data.ptr + canary_size;
+  w_log_event_internal(WATCHDOG_EVENT_ALLOCATED, user_ptr, record->data.size,
+                       record->data.site, now);
+  w_log_event_internal(WATCHDOG_EVENT_FREED, user_ptr, record->data.size,
+                       record->free_site, now);
+}
+
+// Whether per-operation events are logged; constant false when
+// WATCHDOG_FEATURE_EVENTS is compiled out.
+static bool w_verbose_internal(void) {
+  return W_HAS(EVENTS) && verbose_log;
+}
+
+static void w_check_initialization_internal(void) {
+  if (!atomic_load_explicit(&w_initialized, memory_order_acquire)) {
+#if WATCHDOG_PRELOAD
+    WatchdogOptions options = w_preload_options_internal();
+    w_init_with_options(&options);
+#else
+    w_init(true, false, false);
+#endif
+  }
+}
+
+static void w_log_event_internal(const WatchdogEventType op, const void* ptr,
+                                 const size_t size, const uint32_t site,
+                                 const uint64_t timestamp) {
+  WEV event = {
+      .timestamp = timestamp,
+      .ptr = (uint64_t)(uintptr_t)ptr,
+      .size = size,
+      .site = site,
+      .thread = w_thread_id_internal(),
+      .op = op,
+  };
+  w_log_dispatch_internal(&event);
+}
+
+static void w_log_dispatch_internal(const WEV* event) {
+  uint64_t start = w_ticks();
+  // Only the ring path registers; synchronous logging leaves `producers`
+  // alone. Registering before reading `running` again pairs with WER_stop,
+  // which clears `running` before waiting for the count to drop: either
+  // WER_stop waits for this push, or this thread sees the ring stopped.
+  if (atomic_load_explicit(&w_ring.running, memory_order_acquire)) {
+    atomic_fetch_add(&w_ring.producers, 1);
+    if (atomic_load(&w_ring.running)) {
+      // Errors are never dropped, whatever the ring policy says.
+      if (WER_push(event, event->op != WATCHDOG_EVENT_ERROR) ||
+          atomic_load_explicit(&w_ring.running, memory_order_acquire)) {
+        atomic_fetch_sub_explicit(&w_ring.producers, 1, memory_order_release);
+        WLH_record(WLH_LOGGING, start);
+        return;  // queued, or dropped and counted by WER_push
+      }
+    }
+    atomic_fetch_sub_explicit(&w_ring.producers, 1, memory_order_release);
+  }
+  w_log_write_internal(event);
+  // The binary trace is only flushed in batches or when it is closed.
+  if (log_format == WATCHDOG_FORMAT_TEXT) {
+    fflush(w_log_file);
+  }
+  WLH_record(WLH_LOGGING, start);
+}
+
+static void w_log_error_internal(const WatchdogError error,
+                                 const uint32_t site) {
+  w_log_event_internal(WATCHDOG_EVENT_ERROR, NULL, error, site, w_get_time());
+}
+
+static void w_log_bounds_error_internal(const void* ptr, const size_t size,
+                                        const int64_t offset,
+                                        const uint32_t site) {
+  WEV event = {
+      .timestamp = w_get_time(),
+      .ptr = (uint64_t)(uintptr_t)ptr,
+      .size = WATCHDOG_ERROR_OUT_OF_BOUNDS,
+      // Bytes before the start when negative, past the end otherwise.
+      .aux = (uint64_t)(offset < 0 ? offset : offset - (int64_t)size),
+      .site = site,
+      .thread = w_thread_id_internal(),
+      .op = WATCHDOG_EVENT_ERROR,
+  };
+  w_log_dispatch_internal(&event);
+}
+
+static void w_log_write_internal(const WEV* event) {
+  if (log_format == WATCHDOG_FORMAT_BINARY) {
+    WTW_write(event);
+    // Diagnostics are echoed as text so they are not hidden in the trace.
+    if (event->op != WATCHDOG_EVENT_ERROR &&
+        event->op != WATCHDOG_EVENT_ALLOCATED &&
+        event->op != WATCHDOG_EVENT_FREED && event->op != WATCHDOG_EVENT_LEAK) {
+      return;
     }
+  }
+  const WCS* site = &w_call_sites[event->site];
+  time_t when =
+      (time_t)(((int64_t)event->timestamp + w_realtime_offset) / 1000000000LL);
+  if (event->op == WATCHDOG_EVENT_ERROR) {
+    char message[WATCHDOG_ERROR_TEXT_SIZE];
+    watchdog_error_text(event, message, sizeof message);
+    WATCHDOG_LOG_ERROR(when, message, site->file, site->line, site->func);
   } else {
-    w_log_file = stdout;
+    WATCHDOG_LOG(when, watchdog_event_name(event->op),
+                 (void*)(uintptr_t)event->ptr, (size_t)event->size, site->file,
+                 site->line, site->func);
+  }
+}
+
+static void w_log_flush_internal(void) {
+  fflush(w_log_file);
+  if (w_trace.file) {
+    fflush(w_trace.file);
+  }
+}
+
+static uint32_t w_thread_id_internal(void) {
+  if (!w_thread_id) {
+    w_thread_id = atomic_fetch_add_explicit(&w_next_thread_id, 1,
+                                            memory_order_relaxed);
   }
+  return w_thread_id;
 }
+
+static void w_stats_alloc_internal(const size_t size, const uint32_t site) {
+  atomic_fetch_add_explicit(&w_stats.total_allocations, 1,
+                            memory_order_relaxed);
+  size_t usage = atomic_fetch_add_explicit(&w_stats.current_usage, size,
+                                           memory_order_relaxed) +
+                 size;
+  w_stats_peak_internal(&w_stats.peak_usage, usage);
+  WCS* call_site = &w_call_sites[site];
+  atomic_fetch_add_explicit(&call_site->allocations, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&call_site->bytes, size, memory_order_relaxed);
+  usage = atomic_fetch_add_explicit(&call_site->live_bytes, size,
+                                    memory_order_relaxed) +
+          size;
+  w_stats_peak_internal(&call_site->peak_live_bytes, usage);
+  if (sample_rate) {
+    size_t weight = (size_t)w_sample_weight_internal(size);
+    usage = atomic_fetch_add_explicit(&w_stats.estimated_usage, weight,
+                                      memory_order_relaxed) +
+            weight;
+    w_stats_peak_internal(&w_stats.estimated_peak_usage, usage);
+  }
+}
+
+static void w_stats_free_internal(const size_t size, const uint32_t site) {
+  atomic_fetch_sub_explicit(&w_stats.current_usage, size,
+                            memory_order_relaxed);
+  // Publishes the block's allocation count to w_get_stats.
+  atomic_fetch_add_explicit(&w_stats.total_frees, 1, memory_order_release);
+  WCS* call_site = &w_call_sites[site];
+  atomic_fetch_sub_explicit(&call_site->live_bytes, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&call_site->frees, 1, memory_order_relaxed);
+  if (sample_rate) {
+    atomic_fetch_sub_explicit(&w_stats.estimated_usage,
+                              (size_t)w_sample_weight_internal(size),
+                              memory_order_relaxed);
+  }
+}
+
+// Only usage above the stored peak pays for a compare-and-swap.
+static void w_stats_peak_internal(atomic_size_t* peak, const size_t usage) {
+  size_t current = atomic_load_explicit(peak, memory_order_relaxed);
+  while (usage > current &&
+         !atomic_compare_exchange_weak_explicit(peak, &current, usage,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+// Uncontended locks are taken without reading the clock and counted as a
+// zero wait.
+static void w_shard_lock_internal(WS* shard) {
+  if (pthread_mutex_trylock(&shard->mutex) == 0) {
+    if (W_HAS(LATENCY)) {
+      WLH_add_internal(WLH_LOCK_WAIT, 0);
+    }
+    return;
+  }
+  uint64_t start = w_ticks();
+  pthread_mutex_lock(&shard->mutex);
+  WLH_record(WLH_LOCK_WAIT, start);
+}
+
+static void WLH_record(const WatchdogLatencyKind kind, const uint64_t start) {
+  if (!W_HAS(LATENCY)) {
+    return;
+  }
+  uint64_t elapsed = w_ticks() - start;
+  // Counters on other cores may lag slightly behind this one.
+  if ((int64_t)elapsed < 0) {
+    elapsed = 0;
+  }
+  WLH_add_internal(kind, elapsed);
+}
+
+// Adds one sample to this thread's set. The report may read the counters
+// while they change, so they stay atomic, but only this thread writes them.
+static void WLH_add_internal(const WatchdogLatencyKind kind,
+                             const uint64_t elapsed) {
+  WLS* set = w_latency_set ? w_latency_set : WLS_claim_internal();
+  if (!set) {
+    return;
+  }
+  WLH* histogram = &set->histograms[kind];
+  atomic_uint_fast64_t* bucket =
+      &histogram->buckets[WLH_bucket_internal(elapsed)];
+  atomic_store_explicit(bucket,
+                        atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_store_explicit(
+      &histogram->count,
+      atomic_load_explicit(&histogram->count, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+  atomic_store_explicit(
+      &histogram->total,
+      atomic_load_explicit(&histogram->total, memory_order_relaxed) + elapsed,
+      memory_order_relaxed);
+  if (elapsed > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+    atomic_store_explicit(&histogram->max, elapsed, memory_order_relaxed);
+  }
+}
+
+// Gives this thread a set: one released by an exited thread, or a new one.
+static WLS* WLS_claim_internal(void) {
+  WLS* set = atomic_load_explicit(&w_latency_sets, memory_order_acquire);
+  for (; set; set = set->next) {
+    bool owned = false;
+    if (!atomic_load_explicit(&set->owned, memory_order_relaxed) &&
+        atomic_compare_exchange_strong_explicit(&set->owned, &owned, true,
+                                                memory_order_acquire,
+                                                memory_order_relaxed)) {
+      break;
+    }
+  }
+  if (!set) {
+    w_reentry++;
+    set = calloc(1, sizeof *set);
+    w_reentry--;
+    if (!set) {
+      return NULL;
+    }
+    atomic_init(&set->owned, true);
+    set->next = atomic_load_explicit(&w_latency_sets, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &w_latency_sets, &set->next, set, memory_order_release,
+        memory_order_relaxed)) {
+    }
+    atomic_fetch_add_explicit(&w_latency_set_count, 1, memory_order_relaxed);
+  }
+  if (w_latency_key_ready) {
+    w_reentry++;
+    pthread_setspecific(w_latency_key, set);
+    w_reentry--;
+  }
+  w_latency_set = set;
+  return set;
+}
+
+static void WLS_release_internal(void* arg) {
+  WLS* set = arg;
+  w_latency_set = NULL;
+  atomic_store_explicit(&set->owned, false, memory_order_release);
+}
+
+// Sums every thread's set into w_latency for the report.
+static void WLH_merge_internal(void) {
+  memset(w_latency, 0, sizeof w_latency);
+  for (WLS* set = atomic_load_explicit(&w_latency_sets, memory_order_acquire);
+       set; set = set->next) {
+    for (int kind = 0; kind < WLH_COUNT; kind++) {
+      const WLH* from = &set->histograms[kind];
+      WLH* to = &w_latency[kind];
+      for (size_t i = 0; i < WLH_BUCKETS; i++) {
+        to->buckets[i] += atomic_load_explicit(&from->buckets[i],
+                                               memory_order_relaxed);
+      }
+      to->count += atomic_load_explicit(&from->count, memory_order_relaxed);
+      to->total += atomic_load_explicit(&from->total, memory_order_relaxed);
+      uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+      if (max > to->max) {
+        to->max = max;
+      }
+    }
+  }
+}
+
+static size_t WLH_bucket_internal(const uint64_t value) {
+  if (value < WLH_SUB_BUCKETS) {
+    return (size_t)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - WLH_SUB_BUCKET_BITS;
+  return (size_t)(shift + 1) * WLH_SUB_BUCKETS +
+         (size_t)(value >> shift) - WLH_SUB_BUCKETS;
+}
+
+// Largest value that falls into `bucket`.
+static uint64_t WLH_bucket_limit_internal(const size_t bucket) {
+  if (bucket < WLH_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = (int)(bucket / WLH_SUB_BUCKETS) - 1;
+  uint64_t mantissa = WLH_SUB_BUCKETS + bucket % WLH_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+// Smallest bucket limit at or below which `quantile` of the samples fall,
+// capped at the largest sample.
+static uint64_t WLH_percentile(const WLH* histogram, const double quantile) {
+  uint64_t count = atomic_load_explicit(&histogram->count,
+                                        memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  uint64_t rank = (uint64_t)(quantile * (double)count + 0.5);
+  if (!rank) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < WLH_BUCKETS; i++) {
+    seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t limit = WLH_bucket_limit_internal(i);
+      return limit < max ? limit : max;
+    }
+  }
+  return max;
+}
+
+// Nanoseconds per clock tick, measured over the whole run. Short runs are
+// padded so the ratio rests on at least 10 ms.
+static double w_ns_per_tick_internal(void) {
+  uint64_t elapsed = w_get_time() - w_time_base;
+  if (elapsed < 10000000) {
+    struct timespec pause = {0, (long)(10000000 - elapsed)};
+    nanosleep(&pause, NULL);
+  }
+  uint64_t ticks = w_ticks() - w_ticks_base;
+  elapsed = w_get_time() - w_time_base;
+  return ticks ? (double)elapsed / (double)ticks : 1.0;
+}
+
+static void w_report_latency_internal(const double ns_per_tick) {
+  static const char* const names[WLH_COUNT] = {
+      "malloc",    "calloc",           "realloc", "free",
+      "lock wait", "system allocator", "canary",  "logging",
+  };
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  fprintf(w_log_file, "\n%-18s %10s %10s %10s %10s %10s %10s\n",
+          "Latency (ns)", "Count", "p50", "p90", "p99", "p99.9", "Max");
+  for (int kind = 0; kind < WLH_COUNT; kind++) {
+    const WLH* histogram = &w_latency[kind];
+    uint64_t count = atomic_load(&histogram->count);
+    if (!count) {
+      continue;
+    }
+    fprintf(w_log_file, "%-18s %10" PRIu64, names[kind], count);
+    for (size_t q = 0; q < sizeof quantiles / sizeof *quantiles; q++) {
+      fprintf(w_log_file, " %10.0f",
+              WLH_percentile(histogram, quantiles[q]) * ns_per_tick);
+    }
+    fprintf(w_log_file, " %10.0f\n",
+            atomic_load(&histogram->max) * ns_per_tick);
+  }
+}
+
+static void w_report(void) {
+  verbose_log = false;
+  uint64_t now = w_get_time();
+  double estimated_leaks = 0;
+  double estimated_leaked_bytes = 0;
+  // Leaks are grouped by call site in one pass over each shard. Their guards
+  // are still checked, but the blocks go straight back to the system
+  // allocator instead of through w_free, and are not counted as frees.
+  WLG* groups = NULL;
+  size_t group_count = 0;
+  size_t listed = 0;
+  for (size_t i = 0; i < WATCHDOG_SHARDS; i++) {
+    WS* shard = &w_shards[i];
+    w_shard_lock_internal(shard);
+    if (shard->records.size && !groups) {
+      groups = calloc(W_LEAK_GROUPS, sizeof *groups);
+      w_alloc_check_internal(groups, W_LEAK_GROUPS * sizeof *groups, __FILE__,
+                             __LINE__, __func__);
+    }
+    for (size_t j = 0; j < shard->records.size; j++) {
+      WAM data = shard->records.buffer[j];
+      void* user_ptr = (BYTE*)data.ptr + canary_size;
+      // A stack's first frame is the allocating call, so grouping by stack
+      // refines the grouping by site.
+      WLG* group = data.stack ? &groups[data.stack]
+                              : &groups[WATCHDOG_MAX_STACKS + data.site];
+      if (!group->blocks++) {
+        group->site = data.site;
+        group->stack = data.stack;
+        group->smallest = data.size;
+        group_count++;
+      }
+      group->bytes += data.size;
+      group->smallest =
+          data.size < group->smallest ? data.size : group->smallest;
+      group->largest = data.size > group->largest ? data.size : group->largest;
+      if (sample_rate) {
+        double weight = w_sample_weight_internal(data.size);
+        estimated_leaks += weight / data.size;
+        estimated_leaked_bytes += weight;
+      }
+      // The cap keeps the text log short; a binary trace gets every leak,
+      // since wdtrace derives its leak totals from the records.
+      if (listed < report_leak_details ||
+          log_format == WATCHDOG_FORMAT_BINARY) {
+        w_log_event_internal(WATCHDOG_EVENT_LEAK, user_ptr, data.size,
+                             data.site, now);
+        listed++;
+      }
+      int64_t offset;
+      if (!w_canary_intact_internal(data.ptr, data.size, &offset)) {
+        w_log_bounds_error_internal(user_ptr, data.size, offset, data.site);
+      }
+#if !WATCHDOG_PRELOAD
+      w_release_block_internal(data.ptr, data.size);
+#endif
+    }
+#if !WATCHDOG_PRELOAD
+    WS_clear(shard);
+#endif
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  // Sort the groups present to the front, largest first.
+  if (groups) {
+    qsort(groups, W_LEAK_GROUPS, sizeof *groups, WLG_compare_internal);
+  }
+  // Writes to blocks still in quarantine are reported too.
+  for (size_t i = 0; i < WATCHDOG_SHARDS; i++) {
+    w_quarantine_evict_internal(&w_shards[i], 0);
+  }
+  // Everything queued so far must be written before the summary.
+  WER_stop();
+
+  size_t total_allocations = atomic_load(&w_stats.total_allocations);
+  size_t peak_usage = atomic_load(&w_stats.peak_usage);
+
+  fprintf(w_log_file, "\n---Watchdog Report---\n");
+  fprintf(w_log_file, "Total Allocations:  %zu\n", total_allocations);
+  fprintf(w_log_file, "Total Frees:        %zu\n",
+          atomic_load(&w_stats.total_frees));
+  fprintf(w_log_file, "Peak Memory Usage:  %zu Bytes (%.2f MB)\n", peak_usage,
+          peak_usage / 1024.0 / 1024.0);
+  if (!W_HAS(TRACKING)) {
+    // Blocks are not tracked one by one, so leaks are only counted.
+    fprintf(w_log_file, "Live at Exit:       %zu blocks, %zu Bytes\n",
+            total_allocations - atomic_load(&w_stats.total_frees),
+            atomic_load(&w_stats.current_usage));
+  }
+  // Calibration sleeps, so it is skipped when nothing was timed.
+  double ns_per_tick = W_HAS(LATENCY) ? w_ns_per_tick_internal() : 0;
+  if (W_HAS(LATENCY)) {
+    WLH_merge_internal();
+    double total_ticks = 0;
+    for (int kind = WLH_MALLOC; kind <= WLH_FREE; kind++) {
+      total_ticks += atomic_load(&w_latency[kind].total);
+    }
+    fprintf(w_log_file, "Total Tool Latency: %.6f seconds\n",
+            total_ticks * ns_per_tick * 1e-9);
+  }
+  if (w_ring_used) {
+    fprintf(w_log_file, "Dropped Log Events: %zu\n",
+            atomic_load(&w_ring.dropped));
+  }
+  if (sample_rate) {
+    // The counts above cover sampled allocations only.
+    size_t estimated_peak = atomic_load(&w_stats.estimated_peak_usage);
+    fprintf(w_log_file, "Sampling Rate:      1 in %zu Bytes\n", sample_rate);
+    fprintf(w_log_file, "Est. Peak Usage:    %zu Bytes (%.2f MB)\n",
+            estimated_peak, estimated_peak / 1024.0 / 1024.0);
+    fprintf(w_log_file, "Est. Leaks:         %.0f (%.0f Bytes)\n",
+            estimated_leaks, estimated_leaked_bytes);
+  }
+  size_t overhead = w_metadata_overhead_internal();
+  fprintf(w_log_file, "Metadata Overhead:  %zu Bytes (%.2f MB)\n", overhead,
+          overhead / 1024.0 / 1024.0);
+  if (thread_cache_bytes) {
+    // Threads still running contribute the counts folded so far.
+    size_t hits = atomic_load(&w_cache_hits);
+    size_t misses = atomic_load(&w_cache_misses);
+    fprintf(w_log_file,
+            "Thread Cache:       %zu hits, %zu misses (%.1f%% hit rate)\n",
+            hits, misses,
+            hits + misses ? 100.0 * hits / (double)(hits + misses) : 0.0);
+  }
+  if (W_HAS(LATENCY)) {
+    w_report_latency_internal(ns_per_tick);
+  }
+  w_report_leaks_internal(groups, group_count, listed);
+  free(groups);
+  WSS* top_sites[WSS_ORDER_COUNT] = {NULL};
+  size_t top_counts[WSS_ORDER_COUNT] = {0};
+  for (int order = 0; report_top_sites && order < WSS_ORDER_COUNT; order++) {
+    top_sites[order] = malloc(report_top_sites * sizeof(WSS));
+    if (top_sites[order]) {
+      top_counts[order] = WCS_top(top_sites[order], report_top_sites, order);
+    }
+  }
+  w_report_sites_internal(top_sites[WSS_BY_BYTES], top_counts[WSS_BY_BYTES],
+                          "Top Sites by Bytes");
+  w_report_sites_internal(top_sites[WSS_BY_COUNT], top_counts[WSS_BY_COUNT],
+                          "Top Sites by Count");
+  w_report_sites_internal(top_sites[WSS_BY_LIVE_BYTES],
+                          top_counts[WSS_BY_LIVE_BYTES],
+                          "Top Sites by Live Bytes at Exit");
+  for (int order = 0; order < WSS_ORDER_COUNT; order++) {
+    free(top_sites[order]);
+  }
+  w_report_lifetimes_internal();
+  fprintf(w_log_file, "\n");
+  fflush(w_log_file);
+}
+
+static void w_report_leaks_internal(const WLG* groups, const size_t count,
+                                    const size_t listed) {
+  if (!count) {
+    return;
+  }
+  size_t blocks = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    blocks += groups[i].blocks;
+    bytes += groups[i].bytes;
+  }
+  fprintf(w_log_file, "\nLeaks by %s%s: %zu blocks, %zu Bytes",
+          stack_depth ? "Stack" : "Site",
+          sample_rate ? " (sampled allocations)" : "", blocks, bytes);
+  if (listed < blocks) {
+    fprintf(w_log_file, " (%zu listed above)", listed);
+  }
+  fprintf(w_log_file, "\n%14s %10s %10s %10s  %s\n", "Bytes", "Blocks",
+          "Smallest", "Largest", "Site");
+  for (size_t i = 0; i < count; i++) {
+    const WLG* group = &groups[i];
+    const WCS* site = &w_call_sites[group->site];
+    fprintf(w_log_file, "%14zu %10zu %10zu %10zu  %s:%u (%s)\n", group->bytes,
+            group->blocks, group->smallest, group->largest,
+            site->file ? site->file : "??", site->line,
+            site->func ? site->func : "??");
+    WSD_print_internal(group->stack);
+  }
+}
+
+// Both snapshots list their sites by ascending id, so they are merged in one
+// pass. Sites missing from `after` only shrank and are not listed.
+static void w_snapshot_diff_internal(FILE* out, const WatchdogSnapshot* before,
+                                     const WatchdogSnapshot* after) {
+  WSG* growth = malloc((after->count ? after->count : 1) * sizeof *growth);
+  size_t grown = 0;
+  size_t j = 0;
+  for (size_t i = 0; growth && i < after->count; i++) {
+    const WSE* now = &after->sites[i];
+    while (before && j < before->count && before->sites[j].site < now->site) {
+      j++;
+    }
+    WSE then = {.site = now->site};
+    if (before && j < before->count && before->sites[j].site == now->site) {
+      then = before->sites[j];
+    }
+    if (now->bytes > then.bytes ||
+        (now->bytes == then.bytes && now->blocks > then.blocks)) {
+      growth[grown++] = (WSG){
+          .site = now->site,
+          .blocks = (int64_t)now->blocks - (int64_t)then.blocks,
+          .bytes = (int64_t)now->bytes - (int64_t)then.bytes,
+          .live_blocks = now->blocks,
+          .live_bytes = now->bytes,
+      };
+    }
+  }
+  if (growth) {
+    qsort(growth, grown, sizeof *growth, WSG_compare_internal);
+  }
+
+  char time_str[26];
+  time_t now =
+      (time_t)(((int64_t)after->timestamp + w_realtime_offset) / 1000000000LL);
+  ctime_r(&now, time_str);
+  time_str[strlen(time_str) - 1] = '\0';
+  size_t blocks_before = before ? before->blocks : 0;
+  size_t bytes_before = before ? before->bytes : 0;
+  fprintf(out, "\n---Watchdog Snapshot Diff--- %s\n", time_str);
+  if (before) {
+    fprintf(out, "Interval:           %.3f seconds\n",
+            ((int64_t)after->timestamp - (int64_t)before->timestamp) * 1e-9);
+  }
+  fprintf(out, "Live Blocks:        %zu -> %zu (%+lld)\n", blocks_before,
+          after->blocks, (long long)after->blocks - (long long)blocks_before);
+  fprintf(out, "Live Bytes:         %zu -> %zu (%+lld)\n", bytes_before,
+          after->bytes, (long long)after->bytes - (long long)bytes_before);
+  fprintf(out, "Sites That Grew:    %zu%s\n", grown,
+          sample_rate ? " (sampled allocations)" : "");
+  size_t listed = grown < report_top_sites ? grown : report_top_sites;
+  if (listed) {
+    fprintf(out, "%14s %10s %14s %10s  %s\n", "+Bytes", "+Blocks", "Live",
+            "Blocks", "Site");
+  }
+  for (size_t i = 0; i < listed; i++) {
+    const WSG* entry = &growth[i];
+    const WCS* site = &w_call_sites[entry->site];
+    fprintf(out, "%+14lld %+10lld %14zu %10zu  %s:%u (%s)\n",
+            (long long)entry->bytes, (long long)entry->blocks,
+            entry->live_bytes, entry->live_blocks,
+            site->file ? site->file : "??", site->line,
+            site->func ? site->func : "??");
+  }
+  free(growth);
+}
+
+// Orders growth by bytes, descending.
+static int WSG_compare_internal(const void* a, const void* b) {
+  const WSG* left = a;
+  const WSG* right = b;
+  if (left->bytes != right->bytes) {
+    return left->bytes < right->bytes ? 1 : -1;
+  }
+  return (left->site > right->site) - (left->site < right->site);
+}
+
+// Orders leak groups by bytes, descending; empty groups sort last.
+static int WLG_compare_internal(const void* a, const void* b) {
+  const WLG* left = a;
+  const WLG* right = b;
+  if (left->bytes != right->bytes) {
+    return left->bytes < right->bytes ? 1 : -1;
+  }
+  return (left->site > right->site) - (left->site < right->site);
+}
+
+static void w_report_sites_internal(const WSS* summaries, const size_t count,
+                                    const char* title) {
+  if (!count) {
+    return;
+  }
+  fprintf(w_log_file, "\n%s%s:\n", title,
+          sample_rate ? " (sampled allocations)" : "");
+  fprintf(w_log_file, "%14s %10s %10s %14s %14s %10s  %s\n", "Bytes", "Count",
+          "Avg", "Live", "Peak Live", "Frees", "Site");
+  for (size_t i = 0; i < count; i++) {
+    const WSS* summary = &summaries[i];
+    const WCS* site = &w_call_sites[summary->site];
+    fprintf(w_log_file, "%14zu %10zu %10zu %14zu %14zu %10zu  %s:%u (%s)\n",
+            summary->bytes, summary->allocations,
+            summary->bytes / summary->allocations, summary->live_bytes,
+            summary->peak_live_bytes, summary->frees,
+            site->file ? site->file : "??", site->line,
+            site->func ? site->func : "??");
+  }
+}
+
+static size_t WLT_total_internal(const WLT* lifetimes) {
+  size_t total = 0;
+  for (size_t i = 0; i < WLT_BUCKETS; i++) {
+    total += atomic_load_explicit(&lifetimes->buckets[i], memory_order_relaxed);
+  }
+  return total;
+}
+
+// Fills `sites` with up to `limit` sites where most freed blocks were
+// short-lived, most short-lived blocks first, and returns how many.
+static size_t WLT_short_lived(uint32_t* sites, const size_t limit) {
+  size_t count = 0;
+  for (uint32_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    const WLT* lifetimes = &w_lifetimes[i];
+    size_t total = WLT_total_internal(lifetimes);
+    size_t short_lived =
+        atomic_load_explicit(&lifetimes->short_lived, memory_order_relaxed);
+    if (total < WLT_MIN_SAMPLES || short_lived * 2 <= total) {
+      continue;
+    }
+    size_t position = count;
+    while (position > 0 &&
+           atomic_load_explicit(&w_lifetimes[sites[position - 1]].short_lived,
+                                memory_order_relaxed) < short_lived) {
+      position--;
+    }
+    if (position >= limit) {
+      continue;
+    }
+    if (count < limit) {
+      count++;
+    }
+    memmove(&sites[position + 1], &sites[position],
+            (count - position - 1) * sizeof *sites);
+    sites[position] = i;
+  }
+  return count;
+}
+
+// Lists the sites whose blocks mostly die young, with the share of their
+// freed blocks in each lifetime bucket: candidates for arenas or stack
+// buffers.
+static void w_report_lifetimes_internal(void) {
+  if (!w_lifetimes || !report_top_sites) {
+    return;
+  }
+  uint32_t* sites = malloc(report_top_sites * sizeof *sites);
+  if (!sites) {
+    return;
+  }
+  size_t count = WLT_short_lived(sites, report_top_sites);
+  if (count) {
+    static const char* const labels[WLT_BUCKETS] = {
+        "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"};
+    fprintf(w_log_file,
+            "\nShort-Lived Sites (freed within %zu ns or %zu allocations)%s:\n",
+            short_lived_ns, short_lived_allocations,
+            sample_rate ? " (sampled allocations)" : "");
+    fprintf(w_log_file, "%10s %6s", "Freed", "Short");
+    for (size_t i = 0; i < WLT_BUCKETS; i++) {
+      fprintf(w_log_file, " %6s", labels[i]);
+    }
+    fprintf(w_log_file, "  %s\n", "Site");
+  }
+  for (size_t i = 0; i < count; i++) {
+    const WLT* lifetimes = &w_lifetimes[sites[i]];
+    const WCS* site = &w_call_sites[sites[i]];
+    double total = (double)WLT_total_internal(lifetimes);
+    fprintf(w_log_file, "%10.0f %5.0f%%", total,
+            100.0 * atomic_load(&lifetimes->short_lived) / total);
+    for (size_t j = 0; j < WLT_BUCKETS; j++) {
+      fprintf(w_log_file, " %5.0f%%",
+              100.0 * atomic_load(&lifetimes->buckets[j]) / total);
+    }
+    fprintf(w_log_file, "  %s:%u (%s)\n", site->file ? site->file : "??",
+            site->line, site->func ? site->func : "??");
+  }
+  free(sites);
+}
+
+// Memory held by watchdog's own tables. Buffers never shrink, so this is also
+// the high-water mark for the run.
+static size_t w_metadata_overhead_internal(void) {
+  size_t total = sizeof w_shards + sizeof w_call_sites + sizeof w_latency +
+                 sizeof w_guarded_blocks +
+                 sizeof(WLS) * atomic_load(&w_latency_set_count) +
+                 (w_lifetimes ? WATCHDOG_MAX_CALL_SITES * sizeof *w_lifetimes
+                              : 0) +
+                 sizeof *w_stacks * atomic_load(&w_stack_count) +
+                 sizeof *w_ring.slots * (w_ring.slots ? w_ring.capacity : 0);
+  for (size_t i = 0; i < WATCHDOG_SHARDS; i++) {
+    WS* shard = &w_shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    total += sizeof *shard->records.buffer * shard->records.capacity +
+             sizeof *shard->index.buffer * shard->index.capacity +
+             sizeof *shard->history.buffer * shard->history.capacity +
+             sizeof *shard->quarantine.buffer * shard->quarantine.capacity;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  return total;
+}
+
+static uint32_t WCS_intern(const char* file, const int line,
+                           const char* func) {
+  uint64_t key = (uint64_t)(uintptr_t)file * 0x9E3779B97F4A7C15ULL ^
+                 (uint64_t)(uintptr_t)func * 0xC2B2AE3D27D4EB4FULL ^
+                 (uint64_t)(unsigned int)line * 0x165667B19E3779F9ULL;
+  key ^= key >> 29;
+  if (!key) {
+    key = 1;
+  }
+
+  size_t mask = WATCHDOG_MAX_CALL_SITES - 1;
+  size_t i = (size_t)key & mask;
+  for (size_t probes = 0; probes < WATCHDOG_MAX_CALL_SITES;
+       probes++, i = (i + 1) & mask) {
+    if (i == WCS_UNKNOWN) {
+      continue;
+    }
+    WCS* site = &w_call_sites[i];
+    uint_fast64_t current = atomic_load_explicit(&site->key,
+                                                 memory_order_acquire);
+    if (!current) {
+      uint_fast64_t expected = 0;
+      if (atomic_compare_exchange_strong_explicit(
+              &site->key, &expected, key, memory_order_acq_rel,
+              memory_order_acquire)) {
+        site->key_file = file;
+        site->key_func = func;
+        site->line = (unsigned int)line;
+#if WATCHDOG_PRELOAD
+        if (!file) {
+          w_preload_describe_internal(site, func);
+          atomic_store_explicit(&site->ready, true, memory_order_release);
+          return (uint32_t)i;
+        }
+#endif
+#if WATCHDOG_COPY_STRINGS
+        site->file = file ? strdup(file) : NULL;
+        site->func = func ? strdup(func) : NULL;
+#else
+        site->file = file;
+        site->func = func;
+#endif
+        atomic_store_explicit(&site->ready, true, memory_order_release);
+        return (uint32_t)i;
+      }
+      current = expected;
+    }
+    if (current != key) {
+      continue;
+    }
+    while (!atomic_load_explicit(&site->ready, memory_order_acquire)) {
+      sched_yield();
+    }
+    if (site->key_file == file && site->key_func == func &&
+        site->line == (unsigned int)line) {
+      return (uint32_t)i;
+    }
+  }
+  return WCS_UNKNOWN;
+}
+
+static void WCS_init(void) {
+  WCS* unknown = &w_call_sites[WCS_UNKNOWN];
+  unknown->file = "??";
+  unknown->func = "??";
+  unknown->line = 0;
+  atomic_store(&unknown->key, UINT64_MAX);
+  atomic_store(&unknown->ready, true);
+}
+
+static void WCS_cleanup(void) {
+#if WATCHDOG_COPY_STRINGS
+  for (size_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    if (i != WCS_UNKNOWN && atomic_load(&w_call_sites[i].ready)) {
+      free((char*)w_call_sites[i].file);
+      free((char*)w_call_sites[i].func);
+      w_call_sites[i].file = NULL;
+      w_call_sites[i].func = NULL;
+    }
+  }
+#endif
+}
+
+// Captures up to `stack_depth` return addresses starting at `caller`, the
+// return address into the program, and returns the stack's depot id.
+static uint32_t WSD_capture(const void* caller) {
+  void* frames[WATCHDOG_MAX_STACK_DEPTH + WSD_SKIP_SLACK];
+  int count = backtrace(frames, (int)stack_depth + WSD_SKIP_SLACK);
+  int first = 0;
+  while (first < count && frames[first] != caller) {
+    first++;
+  }
+  if (first == count) {
+    // Not on the stack (a tail call); keep everything above this function.
+    first = 1;
+  }
+  uint32_t depth = (uint32_t)(count - first);
+  if (depth > stack_depth) {
+    depth = (uint32_t)stack_depth;
+  }
+  return WSD_intern(frames + first, depth);
+}
+
+// Returns the depot id of a stack, adding it on first sight. Lock-free, like
+// WCS_intern; returns WSD_NONE once the depot is full.
+static uint32_t WSD_intern(void* const* frames, const uint32_t depth) {
+  if (!depth) {
+    return WSD_NONE;
+  }
+  uint64_t key = depth;
+  for (uint32_t i = 0; i < depth; i++) {
+    key = (key ^ (uint64_t)(uintptr_t)frames[i]) * 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 29;
+  }
+  if (!key) {
+    key = 1;
+  }
+
+  size_t mask = WATCHDOG_MAX_STACKS - 1;
+  size_t i = (size_t)key & mask;
+  for (size_t probes = 0; probes < WATCHDOG_MAX_STACKS;
+       probes++, i = (i + 1) & mask) {
+    if (i == WSD_NONE) {
+      continue;
+    }
+    WSD* stack = &w_stacks[i];
+    uint_fast64_t current = atomic_load_explicit(&stack->key,
+                                                 memory_order_acquire);
+    if (!current) {
+      uint_fast64_t expected = 0;
+      if (atomic_compare_exchange_strong_explicit(
+              &stack->key, &expected, key, memory_order_acq_rel,
+              memory_order_acquire)) {
+        stack->depth = depth;
+        memcpy(stack->frames, frames, depth * sizeof *frames);
+        atomic_fetch_add_explicit(&w_stack_count, 1, memory_order_relaxed);
+        atomic_store_explicit(&stack->ready, true, memory_order_release);
+        return (uint32_t)i;
+      }
+      current = expected;
+    }
+    if (current != key) {
+      continue;
+    }
+    while (!atomic_load_explicit(&stack->ready, memory_order_acquire)) {
+      sched_yield();
+    }
+    if (stack->depth == depth &&
+        !memcmp(stack->frames, frames, depth * sizeof *frames)) {
+      return (uint32_t)i;
+    }
+  }
+  return WSD_NONE;
+}
+
+// Prints a depot stack below a report line, one symbolized frame per line.
+static void WSD_print_internal(const uint32_t stack) {
+  if (stack == WSD_NONE) {
+    return;
+  }
+  const WSD* entry = &w_stacks[stack];
+  char** symbols = backtrace_symbols(entry->frames, (int)entry->depth);
+  for (uint32_t i = 0; i < entry->depth; i++) {
+    if (symbols) {
+      fprintf(w_log_file, "%16s#%u %s\n", "", i, symbols[i]);
+    } else {
+      fprintf(w_log_file, "%16s#%u %p\n", "", i, entry->frames[i]);
+    }
+  }
+  free(symbols);
+}
+
+// Fills `summaries` with up to `limit` call sites, largest first by `order`.
+// Sites that never allocated, or hold nothing when ranked by live bytes, are
+// left out. Returns the number of entries written.
+static size_t WCS_top(WSS* summaries, const size_t limit,
+                      const WatchdogSiteOrder order) {
+  size_t count = 0;
+  for (uint32_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    const WCS* site = &w_call_sites[i];
+    if (!atomic_load_explicit(&site->ready, memory_order_acquire)) {
+      continue;
+    }
+    WSS summary = {
+        .site = i,
+        .allocations = atomic_load_explicit(&site->allocations,
+                                            memory_order_relaxed),
+        .frees = atomic_load_explicit(&site->frees, memory_order_relaxed),
+        .bytes = atomic_load_explicit(&site->bytes, memory_order_relaxed),
+        .live_bytes = atomic_load_explicit(&site->live_bytes,
+                                           memory_order_relaxed),
+        .peak_live_bytes = atomic_load_explicit(&site->peak_live_bytes,
+                                                memory_order_relaxed),
+    };
+    size_t key = WSS_key_internal(&summary, order);
+    if (!summary.allocations || !key) {
+      continue;
+    }
+    // Insertion into the sorted prefix; the list is short.
+    size_t position = count;
+    while (position > 0 &&
+           WSS_key_internal(&summaries[position - 1], order) < key) {
+      position--;
+    }
+    if (position >= limit) {
+      continue;
+    }
+    if (count < limit) {
+      count++;
+    }
+    memmove(&summaries[position + 1], &summaries[position],
+            (count - position - 1) * sizeof *summaries);
+    summaries[position] = summary;
+  }
+  return count;
+}
+
+static size_t WSS_key_internal(const WSS* summary,
+                               const WatchdogSiteOrder order) {
+  switch (order) {
+    case WSS_BY_COUNT:
+      return summary->allocations;
+    case WSS_BY_LIVE_BYTES:
+      return summary->live_bytes;
+    default:
+      return summary->bytes;
+  }
+}
+
+static void WTW_open(const char* path) {
+  w_trace.file = fopen(path, "wb");
+  if (!w_trace.file) {
+    fprintf(stderr, "Failed to open trace file: %s\n", path);
+    pthread_mutex_unlock(&w_mutex);
+    exit(EXIT_FAILURE);
+  }
+  atomic_store(&w_trace.records, 0);
+  // Placeholder header; WTW_close rewrites it with the final counts.
+  BYTE header[WATCHDOG_TRACE_RECORDS_OFFSET] = {0};
+  fwrite(header, sizeof header, 1, w_trace.file);
+}
+
+static void WTW_write(const WEV* event) {
+  fwrite(event, sizeof *event, 1, w_trace.file);
+  atomic_fetch_add_explicit(&w_trace.records, 1, memory_order_relaxed);
+}
+
+static void WTW_close(void) {
+  if (!w_trace.file) {
+    return;
+  }
+  WatchdogTraceHeader header = {0};
+  memcpy(header.magic, WATCHDOG_TRACE_MAGIC, sizeof WATCHDOG_TRACE_MAGIC);
+  header.version = WATCHDOG_TRACE_VERSION;
+  header.record_size = sizeof(WEV);
+  header.record_count = atomic_load(&w_trace.records);
+  header.records_offset = WATCHDOG_TRACE_RECORDS_OFFSET;
+  header.sites_offset =
+      header.records_offset + header.record_count * header.record_size;
+  header.realtime_offset = w_realtime_offset;
+
+  // Site entries first, then the string blob they point into.
+  uint32_t string_offset = 0;
+  for (uint32_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    const WCS* site = &w_call_sites[i];
+    if (!atomic_load(&site->ready)) {
+      continue;
+    }
+    const char* file = site->file ? site->file : "??";
+    const char* func = site->func ? site->func : "??";
+    WatchdogTraceSite entry = {i, site->line, string_offset,
+                               string_offset + (uint32_t)strlen(file) + 1};
+    string_offset = entry.func_offset + (uint32_t)strlen(func) + 1;
+    fwrite(&entry, sizeof entry, 1, w_trace.file);
+    header.site_count++;
+  }
+  header.strings_offset =
+      header.sites_offset + header.site_count * sizeof(WatchdogTraceSite);
+  header.strings_size = string_offset;
+  for (uint32_t i = 0; i < WATCHDOG_MAX_CALL_SITES; i++) {
+    const WCS* site = &w_call_sites[i];
+    if (!atomic_load(&site->ready)) {
+      continue;
+    }
+    const char* file = site->file ? site->file : "??";
+    const char* func = site->func ? site->func : "??";
+    fwrite(file, strlen(file) + 1, 1, w_trace.file);
+    fwrite(func, strlen(func) + 1, 1, w_trace.file);
+  }
+
+  fseek(w_trace.file, 0, SEEK_SET);
+  fwrite(&header, sizeof header, 1, w_trace.file);
+  fclose(w_trace.file);
+  w_trace.file = NULL;
+}
+
+// Joins one of watchdog's threads. While joining, glibc may release the
+// thread-local storage of threads the program has exited, which was
+// allocated through the interposers, so the join runs outside watchdog.
+static void w_join_internal(pthread_t thread) {
+  unsigned int reentry = w_reentry;
+  w_reentry = 0;
+  pthread_join(thread, NULL);
+  w_reentry = reentry;
+}
+
+// Only the forking thread survives a fork, so the child has none of
+// watchdog's threads: it logs synchronously from here on. The trace belongs
+// to the parent, so the child's copy of its descriptor is pointed at
+// /dev/null; neither the child's events nor the records the parent had
+// buffered when it forked are written to it twice.
+static void w_fork_child_internal(void) {
+  atomic_store(&w_ring.running, false);
+  atomic_store(&w_ring.producers, 0);
+  atomic_store(&w_ring.stop, true);
+  w_reporter.running = false;
+  w_scrubber.running = false;
+  if (w_snapshots.running) {
+    sigaction(w_snapshots.signal, &w_snapshots.previous, NULL);
+    w_snapshots.running = false;
+  }
+  if (w_trace.file) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, fileno(w_trace.file));
+      close(null);
+    }
+  }
+}
+
+static void WER_start(size_t capacity, WatchdogRingPolicy policy) {
+  // WER_stop waited for every producer that saw the previous ring running,
+  // and later ones log synchronously until `running` is set below.
+  free(w_ring.slots);
+  size_t rounded = 2;
+  while (rounded < capacity) {
+    rounded *= 2;
+  }
+  w_ring.capacity = rounded;
+  w_ring.policy = policy;
+  w_ring.slots = malloc(sizeof *w_ring.slots * w_ring.capacity);
+  w_alloc_check_internal(w_ring.slots, sizeof *w_ring.slots * w_ring.capacity,
+                         __FILE__, __LINE__, __func__);
+  for (size_t i = 0; i < w_ring.capacity; i++) {
+    atomic_init(&w_ring.slots[i].sequence, i);
+  }
+  atomic_store(&w_ring.head, 0);
+  w_ring.tail = 0;
+  atomic_store(&w_ring.stop, false);
+  if (pthread_create(&w_ring.writer, NULL, WER_writer_internal, NULL) != 0) {
+    // Without a writer the ring would fill up; stay synchronous instead.
+    free(w_ring.slots);
+    w_ring.slots = NULL;
+    fprintf(stderr, "Failed to start the watchdog log writer thread.\n");
+    return;
+  }
+  w_ring_used = true;
+  atomic_store_explicit(&w_ring.running, true, memory_order_release);
+}
+
+static void WER_stop(void) {
+  if (!atomic_load_explicit(&w_ring.running, memory_order_acquire)) {
+    return;
+  }
+  // New producers log synchronously from here on. Those already pushing
+  // publish their slots (or, when blocked on a full ring, give up and log
+  // synchronously) while the writer keeps draining.
+  atomic_store(&w_ring.running, false);
+  while (atomic_load_explicit(&w_ring.producers, memory_order_acquire)) {
+    sched_yield();
+  }
+  atomic_store_explicit(&w_ring.stop, true, memory_order_release);
+  w_join_internal(w_ring.writer);
+  // The writer exits once the ring looks empty; pick up anything it missed.
+  WEV event;
+  while (WER_pop(&event)) {
+    w_log_write_internal(&event);
+  }
+  w_log_flush_internal();
+}
+
+static void WER_cleanup(void) {
+  WER_stop();
+  free(w_ring.slots);
+  w_ring.slots = NULL;
+}
+
+static bool WER_push(const WEV* event, bool may_drop) {
+  size_t pos = atomic_load_explicit(&w_ring.head, memory_order_relaxed);
+  for (;;) {
+    WES* slot = &w_ring.slots[pos & (w_ring.capacity - 1)];
+    size_t sequence =
+        atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&w_ring.head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->event = *event;
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // Full: the writer has not yet consumed the slot from one lap ago.
+      if (may_drop && w_ring.policy == WATCHDOG_RING_DROP) {
+        atomic_fetch_add_explicit(&w_ring.dropped, 1, memory_order_relaxed);
+        return false;
+      }
+      if (!atomic_load_explicit(&w_ring.running, memory_order_acquire)) {
+        return false;
+      }
+      sched_yield();
+      pos = atomic_load_explicit(&w_ring.head, memory_order_relaxed);
+    } else {
+      pos = atomic_load_explicit(&w_ring.head, memory_order_relaxed);
+    }
+  }
+}
+
+static bool WER_pop(WEV* event) {
+  if (!w_ring.slots) {
+    return false;
+  }
+  WES* slot = &w_ring.slots[w_ring.tail & (w_ring.capacity - 1)];
+  size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+  if (sequence != w_ring.tail + 1) {
+    return false;
+  }
+  *event = slot->event;
+  atomic_store_explicit(&slot->sequence, w_ring.tail + w_ring.capacity,
+                        memory_order_release);
+  w_ring.tail++;
+  return true;
+}
+
+static void* WER_writer_internal(void* arg) {
+  (void)arg;
+  // Anything stdio allocates on this thread belongs to watchdog.
+  w_reentry++;
+  WEV event;
+  for (;;) {
+    bool stopping = atomic_load_explicit(&w_ring.stop, memory_order_acquire);
+    size_t written = 0;
+    while (written < WER_BATCH_SIZE && WER_pop(&event)) {
+      w_log_write_internal(&event);
+      written++;
+    }
+    if (written) {
+      w_log_flush_internal();
+      continue;
+    }
+    if (stopping) {
+      return NULL;
+    }
+    struct timespec idle = {0, WER_IDLE_SLEEP_NS};
+    nanosleep(&idle, NULL);
+  }
+}
+
+static void WPT_start(WPT* periodic, size_t interval_ms) {
+  periodic->interval_ns = (uint64_t)interval_ms * 1000000ULL;
+  periodic->stop = false;
+  if (pthread_create(&periodic->thread, NULL, WPT_thread_internal, periodic) !=
+      0) {
+    fprintf(stderr, "Failed to start the watchdog %s thread.\n",
+            periodic->name);
+    return;
+  }
+  periodic->running = true;
+}
+
+static void WPT_stop(WPT* periodic) {
+  if (!periodic->running) {
+    return;
+  }
+  pthread_mutex_lock(&periodic->mutex);
+  periodic->stop = true;
+  pthread_cond_signal(&periodic->wake);
+  pthread_mutex_unlock(&periodic->mutex);
+  w_join_internal(periodic->thread);
+  periodic->running = false;
+}
+
+static void* WPT_thread_internal(void* arg) {
+  WPT* periodic = arg;
+  // Anything stdio allocates on this thread belongs to watchdog.
+  w_reentry++;
+#ifdef SCHED_IDLE
+  if (periodic->idle_priority) {
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  }
+#endif
+  if (periodic->start) {
+    periodic->start();
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  pthread_mutex_lock(&periodic->mutex);
+  for (;;) {
+    uint64_t nsec = (uint64_t)deadline.tv_nsec + periodic->interval_ns;
+    deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+    deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+    while (!periodic->stop &&
+           pthread_cond_timedwait(&periodic->wake, &periodic->mutex,
+                                  &deadline) == 0) {
+    }
+    if (periodic->stop) {
+      break;
+    }
+    periodic->tick();
+  }
+  pthread_mutex_unlock(&periodic->mutex);
+  return NULL;
+}
+
+static void w_stats_start_internal(void) { w_stats_last = w_get_stats(); }
+
+static void w_stats_tick_internal(void) {
+  WatchdogStatsSnapshot stats = w_get_stats();
+  WatchdogStatsSnapshot last = w_stats_last;
+  double seconds = (stats.timestamp - last.timestamp) * 1e-9;
+  char time_str[26];
+  time_t now =
+      (time_t)(((int64_t)stats.timestamp + w_realtime_offset) / 1000000000LL);
+  ctime_r(&now, time_str);
+  time_str[strlen(time_str) - 1] = '\0';
+  fprintf(w_log_file,
+          "[STATS] %s: %zu Bytes in use (peak %zu), %zu live, %.0f "
+          "allocs/s, %.0f frees/s\n",
+          time_str, stats.current_usage, stats.peak_usage,
+          stats.live_allocations,
+          (stats.total_allocations - last.total_allocations) / seconds,
+          (stats.total_frees - last.total_frees) / seconds);
+  fflush(w_log_file);
+  w_stats_last = stats;
+}
+
+static void WSW_start(const int signal, const char* path) {
+  if (signal <= 0 || signal >= NSIG) {
+    fprintf(stderr, "Invalid watchdog snapshot signal: %d\n", signal);
+    return;
+  }
+  w_snapshots.file = fopen(path, "a");
+  if (!w_snapshots.file) {
+    fprintf(stderr, "Failed to open snapshot file: %s\n", path);
+    return;
+  }
+  sem_init(&w_snapshots.wake, 0, 0);
+  atomic_store(&w_snapshots.stop, false);
+  if (pthread_create(&w_snapshots.thread, NULL, WSW_thread_internal, NULL) !=
+      0) {
+    fprintf(stderr, "Failed to start the watchdog snapshot thread.\n");
+    fclose(w_snapshots.file);
+    w_snapshots.file = NULL;
+    sem_destroy(&w_snapshots.wake);
+    return;
+  }
+  struct sigaction action = {.sa_handler = w_snapshot_signal_internal,
+                             .sa_flags = SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(signal, &action, &w_snapshots.previous);
+  w_snapshots.signal = signal;
+  w_snapshots.running = true;
+}
+
+static void WSW_stop(void) {
+  if (!w_snapshots.running) {
+    return;
+  }
+  sigaction(w_snapshots.signal, &w_snapshots.previous, NULL);
+  atomic_store(&w_snapshots.stop, true);
+  sem_post(&w_snapshots.wake);
+  w_join_internal(w_snapshots.thread);
+  sem_destroy(&w_snapshots.wake);
+  fclose(w_snapshots.file);
+  w_snapshots.file = NULL;
+  w_snapshot_free(w_snapshots.last);
+  w_snapshots.last = NULL;
+  w_snapshots.running = false;
+}
+
+static void* WSW_thread_internal(void* arg) {
+  (void)arg;
+  // Anything stdio allocates on this thread belongs to watchdog.
+  w_reentry++;
+  for (;;) {
+    while (sem_wait(&w_snapshots.wake) != 0 && errno == EINTR) {
+    }
+    if (atomic_load(&w_snapshots.stop)) {
+      break;
+    }
+    WatchdogSnapshot* snapshot = w_snapshot();
+    if (!snapshot) {
+      continue;
+    }
+    w_snapshot_diff_internal(w_snapshots.file, w_snapshots.last, snapshot);
+    fflush(w_snapshots.file);
+    w_snapshot_free(w_snapshots.last);
+    w_snapshots.last = snapshot;
+  }
+  return NULL;
+}
+
+// Only async-signal-safe work here: wake the writer.
+static void w_snapshot_signal_internal(int signal) {
+  (void)signal;
+  int saved = errno;
+  sem_post(&w_snapshots.wake);
+  errno = saved;
+}
+
+// Checks up to `scrub_blocks_per_tick` live blocks, holding one shard lock at
+// a time and never for more than that many blocks. Damaged blocks are
+// reported once, with their allocation site, after the lock is released.
+static void w_scrub_tick_internal(void) {
+  WAM damaged[WATCHDOG_SCRUB_REPORT_BATCH];
+  int64_t offsets[WATCHDOG_SCRUB_REPORT_BATCH];
+  size_t budget = scrub_blocks_per_tick;
+  // Bounded so a tick over empty shards ends after one round.
+  for (size_t round = 0; budget && round < WATCHDOG_SHARDS; round++) {
+    WS* shard = &w_shards[w_scrub_shard];
+    size_t found = 0;
+    w_shard_lock_internal(shard);
+    size_t count = shard->records.size;
+    while (budget && w_scrub_index < count &&
+           found < WATCHDOG_SCRUB_REPORT_BATCH) {
+      WAM* data = &shard->records.buffer[w_scrub_index++];
+      budget--;
+      if (data->scrub_reported ||
+          w_canary_intact_internal(data->ptr, data->size, &offsets[found])) {
+        continue;
+      }
+      data->scrub_reported = true;
+      damaged[found++] = *data;
+    }
+    bool finished = w_scrub_index >= count;
+    pthread_mutex_unlock(&shard->mutex);
+    for (size_t i = 0; i < found; i++) {
+      w_log_bounds_error_internal((BYTE*)damaged[i].ptr + canary_size,
+                                  damaged[i].size, offsets[i],
+                                  damaged[i].site);
+    }
+    if (finished) {
+      w_scrub_shard = (w_scrub_shard + 1) & (WATCHDOG_SHARDS - 1);
+      w_scrub_index = 0;
+    }
+  }
+}
+
+static WS* WS_for_internal(const void* ptr) {
+  // The index uses the low hash bits, so pick the shard from the high ones.
+  return &w_shards[(WHT_hash_internal(ptr) >> 48) & (WATCHDOG_SHARDS - 1)];
+}
+
+static void WS_init(WS* shard) {
+  pthread_mutex_init(&shard->mutex, NULL);
+  WDA_init(&shard->records);
+  WHT_init(&shard->index);
+  WFH_init(&shard->history,
+           (WATCHDOG_FREED_HISTORY_SIZE + WATCHDOG_SHARDS - 1) /
+               WATCHDOG_SHARDS);
+  WQ_init(&shard->quarantine);
+}
+
+// Adds a live record to the shard. The caller must hold the shard lock.
+static void WS_insert(WS* shard, const WAM* data) {
+  size_t index = WDA_push(&shard->records, data);
+#if WATCHDOG_INLINE_HEADER
+  WBH_write(data->ptr, data->size, index, data->site);
+#else
+  WHT_insert(&shard->index, data->ptr, index);
+#endif
+}
+
+// Finds the position of the live record for a padded block pointer. The
+// caller must hold the shard lock.
+static bool WS_find(const WS* shard, const void* ptr, size_t* index) {
+#if WATCHDOG_INLINE_HEADER
+  return WBH_find(shard, ptr, index);
+#else
+  return WHT_find(&shard->index, ptr, index);
+#endif
+}
+
+// Drops the live record at `index`. The caller must hold the shard lock.
+static void WS_remove(WS* shard, const size_t index) {
+#if !WATCHDOG_INLINE_HEADER
+  WHT_remove(&shard->index, shard->records.buffer[index].ptr);
+#endif
+  if (!WDA_remove(&shard->records, index)) {
+    return;
+  }
+  // The last record moved into `index`; re-point whatever locates it.
+#if WATCHDOG_INLINE_HEADER
+  ((WBH*)shard->records.buffer[index].ptr)->index = index;
+#else
+  WHT_update(&shard->index, shard->records.buffer[index].ptr, index);
+#endif
+}
+
+// Updates a live record whose block kept its address through a realloc. The
+// caller must hold the shard lock.
+static void WS_resize(WS* shard, const size_t index, const size_t size,
+                      const uint32_t site, const uint32_t stack) {
+  WAM* data = &shard->records.buffer[index];
+  data->size = size;
+  data->site = site;
+  data->stack = stack;
+  // Like a moved block, the resized one starts a new lifetime at `site`.
+  w_lifetime_stamp_internal(data);
+  // Realloc restamps guards it found damaged.
+  data->scrub_reported = false;
+#if WATCHDOG_INLINE_HEADER
+  WBH_write(data->ptr, size, index, site);
+#endif
+}
+
+#if !WATCHDOG_PRELOAD
+// Forgets every live record once their blocks are released. The caller must
+// hold the shard lock.
+static void WS_clear(WS* shard) {
+  shard->records.size = 0;
+#if !WATCHDOG_INLINE_HEADER
+  WHT_cleanup(&shard->index);
+  WHT_init(&shard->index);
+#endif
+}
+#endif
+
+static void WS_cleanup(WS* shard) {
+  WHT_cleanup(&shard->index);
+  WDA_cleanup(&shard->records);
+  WFH_cleanup(&shard->history);
+  WQ_cleanup(&shard->quarantine);
+}
+
+#if WATCHDOG_INLINE_HEADER
+static uint64_t WBH_check_internal(const void* ptr, const size_t size) {
+  uint64_t check = (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ULL ^
+                   (uint64_t)size * 0xC2B2AE3D27D4EB4FULL;
+  return (check ^ (check >> 31)) ^ WBH_MAGIC;
+}
+
+static void WBH_write(void* ptr, const size_t size, const size_t index,
+                      const uint32_t site) {
+  w_note_block_internal(ptr);
+  WBH* header = ptr;
+  header->check = WBH_check_internal(ptr, size);
+  header->size = size;
+  header->index = index;
+  header->site = site;
+  header->reserved = 0;
+}
+
+// O(1) lookup through the inline header. Only aligned pointers inside the
+// range of tracked blocks are dereferenced, and the header's record position
+// is trusted only when the record there points back at the same block. A
+// damaged `check` is left to the canary check, which reports it against the
+// block; a block whose `index` was overwritten too is reported as untracked.
+static bool WBH_find(const WS* shard, const void* ptr, size_t* index) {
+  uintptr_t address = (uintptr_t)ptr;
+  if (address % _Alignof(max_align_t) ||
+      address < atomic_load_explicit(&w_block_min, memory_order_relaxed) ||
+      address > atomic_load_explicit(&w_block_max, memory_order_relaxed) ||
+      !w_prefix_mapped_internal((const BYTE*)ptr + canary_size,
+                                canary_size)) {
+    return false;
+  }
+  const WBH* header = ptr;
+  if (header->index >= shard->records.size ||
+      shard->records.buffer[header->index].ptr != ptr) {
+    return false;
+  }
+  *index = header->index;
+  return true;
+}
+
+#endif  // WATCHDOG_INLINE_HEADER
+
+static void WDA_init(WDA* array) {
+  array->size = 0;
+  array->capacity = WDA_DEFAULT_BUFFER_SIZE;
+  array->buffer = malloc(sizeof *array->buffer * array->capacity);
+  w_alloc_check_internal(array->buffer, sizeof *array->buffer * array->capacity,
+                         __FILE__, __LINE__, __func__);
+}
+
+static size_t WDA_push(WDA* array, const WAM* data) {
+  if (array->size == array->capacity) {
+    WDA_expand_capacity_internal(array);
+  }
+  array->buffer[array->size] = *data;
+  return array->size++;
+}
+
+// Swaps the last record into `index` so removal stays O(1). Returns true when
+// a record was moved, in which case the caller must re-point its index entry.
+static bool WDA_remove(WDA* array, const size_t index) {
+  size_t last = --array->size;
+  if (index == last) {
+    return false;
+  }
+  array->buffer[index] = array->buffer[last];
+  return true;
+}
+
+static void WDA_cleanup(WDA* array) {
+  free(array->buffer);
+  array->buffer = NULL;
+  array->size = 0;
+  array->capacity = 0;
+}
+
+static void WDA_expand_capacity_internal(WDA* array) {
+  array->capacity *= WDA_GROWTH_FACTOR;
+  WAM* buffer =
+      realloc(array->buffer, sizeof *array->buffer * array->capacity);
+  w_alloc_check_internal(buffer, sizeof *array->buffer * array->capacity,
+                         __FILE__, __LINE__, __func__);
+  array->buffer = buffer;
+}
+
+static void w_configure_log_destination_internal(bool enable_file_log) {
+  if (w_log_file && w_log_file != stdout) {
+    fclose(w_log_file);
+    w_log_file = NULL;
+  }
+
+  log_to_file = enable_file_log;
+  if (log_to_file) {
+    w_log_file = fopen(log_file_name, "a");
+    if (!w_log_file) {
+      fprintf(stderr, "Failed to open log file: %s\n", log_file_name);
+      pthread_mutex_unlock(&w_mutex);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    w_log_file = stdout;
+  }
+}
+
+static size_t WHT_hash_internal(const void* ptr) {
+  // Fibonacci hashing; the low bits of heap pointers are mostly alignment.
+  uint64_t key = (uint64_t)(uintptr_t)ptr;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return (size_t)(key ^ (key >> 32));
+}
+
+static void WHT_init(WHT* table) {
+  table->size = 0;
+  table->capacity = WHT_DEFAULT_CAPACITY;
+  table->buffer = calloc(table->capacity, sizeof *table->buffer);
+  w_alloc_check_internal(table->buffer, sizeof *table->buffer * table->capacity,
+                         __FILE__, __LINE__, __func__);
+}
+
+// The index is only consulted without inline headers.
+#if !WATCHDOG_INLINE_HEADER
+static void WHT_insert(WHT* table, const void* ptr, const size_t index) {
+  if ((table->size + 1) * 100 > table->capacity * WHT_MAX_LOAD_PERCENT) {
+    WHT_expand_capacity_internal(table);
+  }
+  size_t mask = table->capacity - 1;
+  size_t i = WHT_hash_internal(ptr) & mask;
+  while (table->buffer[i].ptr) {
+    i = (i + 1) & mask;
+  }
+  table->buffer[i].ptr = ptr;
+  table->buffer[i].index = index;
+  table->size++;
+}
+
+static bool WHT_find(const WHT* table, const void* ptr, size_t* index) {
+  if (!table->buffer || !ptr) {
+    return false;
+  }
+  size_t mask = table->capacity - 1;
+  size_t i = WHT_hash_internal(ptr) & mask;
+  while (table->buffer[i].ptr) {
+    if (table->buffer[i].ptr == ptr) {
+      *index = table->buffer[i].index;
+      return true;
+    }
+    i = (i + 1) & mask;
+  }
+  return false;
+}
+
+static void WHT_update(WHT* table, const void* ptr, const size_t index) {
+  size_t mask = table->capacity - 1;
+  size_t i = WHT_hash_internal(ptr) & mask;
+  while (table->buffer[i].ptr) {
+    if (table->buffer[i].ptr == ptr) {
+      table->buffer[i].index = index;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static void WHT_remove(WHT* table, const void* ptr) {
+  size_t mask = table->capacity - 1;
+  size_t i = WHT_hash_internal(ptr) & mask;
+  while (table->buffer[i].ptr && table->buffer[i].ptr != ptr) {
+    i = (i + 1) & mask;
+  }
+  if (!table->buffer[i].ptr) {
+    return;
+  }
+  table->buffer[i].ptr = NULL;
+  table->size--;
+
+  // Backward-shift deletion: pull later entries of the probe run into the
+  // hole so lookups never need tombstones.
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!table->buffer[j].ptr) {
+      break;
+    }
+    size_t home = WHT_hash_internal(table->buffer[j].ptr) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table->buffer[i] = table->buffer[j];
+      table->buffer[j].ptr = NULL;
+      i = j;
+    }
+  }
+}
+
+#endif  // !WATCHDOG_INLINE_HEADER
+
+static void WHT_cleanup(WHT* table) {
+  free(table->buffer);
+  table->buffer = NULL;
+  table->size = 0;
+  table->capacity = 0;
+}
+
+#if !WATCHDOG_INLINE_HEADER
+static void WHT_expand_capacity_internal(WHT* table) {
+  WHE* old_buffer = table->buffer;
+  size_t old_capacity = table->capacity;
+
+  table->capacity *= WDA_GROWTH_FACTOR;
+  table->buffer = calloc(table->capacity, sizeof *table->buffer);
+  w_alloc_check_internal(table->buffer, sizeof *table->buffer * table->capacity,
+                         __FILE__, __LINE__, __func__);
+  table->size = 0;
+
+  size_t mask = table->capacity - 1;
+  for (size_t j = 0; j < old_capacity; j++) {
+    if (!old_buffer[j].ptr) {
+      continue;
+    }
+    size_t i = WHT_hash_internal(old_buffer[j].ptr) & mask;
+    while (table->buffer[i].ptr) {
+      i = (i + 1) & mask;
+    }
+    table->buffer[i] = old_buffer[j];
+    table->size++;
+  }
+  free(old_buffer);
+}
+#endif  // !WATCHDOG_INLINE_HEADER
+
+static void WFH_init(WFH* history, size_t capacity) {
+  history->buffer = NULL;
+  history->head = 0;
+  history->size = 0;
+  history->capacity = capacity;
+  if (history->capacity) {
+    history->buffer = malloc(sizeof *history->buffer * history->capacity);
+    w_alloc_check_internal(history->buffer,
+                           sizeof *history->buffer * history->capacity,
+                           __FILE__, __LINE__, __func__);
+  }
+}
+
+static void WFH_push(WFH* history, const WAM* data, const uint32_t free_site) {
+  if (!history->capacity) {
+    return;
+  }
+  WFR* record = &history->buffer[history->head];
+  if (history->size < history->capacity) {
+    history->size++;
+  }
+  record->data = *data;
+  record->free_site = free_site;
+  history->head = (history->head + 1) % history->capacity;
+}
+
+static bool WFH_find(const WFH* history, const void* ptr, WFR* out) {
+  // Newest first, so a reused address reports its most recent free. This is
+  // only reached on the error path, after the live index missed.
+  for (size_t n = 0; n < history->size; n++) {
+    size_t i = (history->head + history->capacity - 1 - n) % history->capacity;
+    if (history->buffer[i].data.ptr == ptr) {
+      *out = history->buffer[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+static void WFH_cleanup(WFH* history) {
+  free(history->buffer);
+  history->buffer = NULL;
+  history->head = 0;
+  history->size = 0;
+  history->capacity = 0;
+}
+
+// The buffer is only allocated when the first block is quarantined.
+static void WQ_init(WQ* quarantine) {
+  quarantine->buffer = NULL;
+  quarantine->head = 0;
+  quarantine->size = 0;
+  quarantine->capacity = 0;
+  quarantine->bytes = 0;
+}
+
+static void WQ_push(WQ* quarantine, const WAM* data, const uint32_t free_site) {
+  if (quarantine->size == quarantine->capacity) {
+    size_t capacity =
+        quarantine->capacity ? quarantine->capacity * 2 : WQ_DEFAULT_CAPACITY;
+    WFR* buffer = malloc(sizeof *buffer * capacity);
+    w_alloc_check_internal(buffer, sizeof *buffer * capacity, __FILE__,
+                           __LINE__, __func__);
+    // Unwrap the ring so the entries start at 0 again.
+    for (size_t n = 0; n < quarantine->size; n++) {
+      buffer[n] =
+          quarantine->buffer[(quarantine->head + n) % quarantine->capacity];
+    }
+    free(quarantine->buffer);
+    quarantine->buffer = buffer;
+    quarantine->head = 0;
+    quarantine->capacity = capacity;
+  }
+  WFR* record = &quarantine->buffer[(quarantine->head + quarantine->size) %
+                                    quarantine->capacity];
+  record->data = *data;
+  record->free_site = free_site;
+  quarantine->size++;
+  quarantine->bytes += data->size;
+}
+
+// Removes and returns the oldest entry. The quarantine must not be empty.
+static WFR WQ_pop(WQ* quarantine) {
+  WFR record = quarantine->buffer[quarantine->head];
+  quarantine->head = (quarantine->head + 1) % quarantine->capacity;
+  quarantine->size--;
+  quarantine->bytes -= record.data.size;
+  return record;
+}
+
+static bool WQ_find(const WQ* quarantine, const void* ptr, WFR* out) {
+  for (size_t n = 0; n < quarantine->size; n++) {
+    const WFR* record =
+        &quarantine->buffer[(quarantine->head + n) % quarantine->capacity];
+    if (record->data.ptr == ptr) {
+      *out = *record;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Blocks still quarantined are released by w_report before this runs.
+static void WQ_cleanup(WQ* quarantine) {
+  free(quarantine->buffer);
+  WQ_init(quarantine);
+}
+
+//------------------------------------------------------------------------------
+// LD_PRELOAD interposition (make preload)
+//------------------------------------------------------------------------------
+
+#if WATCHDOG_PRELOAD
+
+// Enough for what dlsym and the loader allocate before the real allocator
+// is resolved. Blocks carry their size in front so realloc can copy them;
+// they are never reused.
+#define W_BOOTSTRAP_SIZE (64 * 1024)
+#define W_BOOTSTRAP_HEADER 16
+
+static _Alignas(16) BYTE w_bootstrap[W_BOOTSTRAP_SIZE];
+static size_t w_bootstrap_used = 0;
+static bool w_preload_resolving = false;
+
+static void* (*w_real_malloc)(size_t) = NULL;
+static void* (*w_real_calloc)(size_t, size_t) = NULL;
+static void* (*w_real_realloc)(void*, size_t) = NULL;
+static void (*w_real_free)(void*) = NULL;
+static int (*w_real_posix_memalign)(void**, size_t, size_t) = NULL;
+static void* (*w_real_aligned_alloc)(size_t, size_t) = NULL;
+static void* (*w_real_memalign)(size_t, size_t) = NULL;
+static size_t (*w_real_malloc_usable_size)(void*) = NULL;
+
+static void* w_bootstrap_alloc_internal(size_t size) {
+  size_t needed = W_BOOTSTRAP_HEADER + ((size + 15) & ~(size_t)15);
+  if (needed > W_BOOTSTRAP_SIZE - w_bootstrap_used) {
+    return NULL;
+  }
+  BYTE* block = w_bootstrap + w_bootstrap_used;
+  w_bootstrap_used += needed;
+  memcpy(block, &size, sizeof size);
+  return block + W_BOOTSTRAP_HEADER;
+}
+
+static bool w_bootstrap_owns_internal(const void* ptr) {
+  return (const BYTE*)ptr >= w_bootstrap &&
+         (const BYTE*)ptr < w_bootstrap + W_BOOTSTRAP_SIZE;
+}
+
+// Runs on the first allocation, before any other thread can exist. dlsym
+// may itself allocate; those requests are served from the bootstrap arena.
+static bool w_preload_resolve_internal(void) {
+  if (w_real_free) {
+    return true;
+  }
+  if (w_preload_resolving) {
+    return false;
+  }
+  w_preload_resolving = true;
+  w_real_malloc = (void* (*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  w_real_calloc = (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  w_real_realloc = (void* (*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+  w_real_posix_memalign =
+      (int (*)(void**, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+  w_real_aligned_alloc =
+      (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+  w_real_memalign = (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+  w_real_malloc_usable_size =
+      (size_t(*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+  w_real_free = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+  w_preload_resolving = false;
+  if (!w_real_malloc || !w_real_calloc || !w_real_realloc || !w_real_free) {
+    fprintf(stderr, "watchdog: cannot find the system allocator\n");
+    abort();
+  }
+  return true;
+}
+
+static bool w_preload_flag_internal(const char* name, bool fallback) {
+  const char* value = getenv(name);
+  return value ? value[0] == '1' : fallback;
+}
+
+static size_t w_preload_size_internal(const char* name, size_t fallback) {
+  const char* value = getenv(name);
+  return value ? (size_t)strtoull(value, NULL, 0) : fallback;
+}
+
+// Reads a file path from the environment, with each %p replaced by the
+// process ID. Returns NULL when the variable is unset, empty or too long.
+static const char* w_preload_path_internal(const char* name, char* path,
+                                           const size_t capacity) {
+  const char* value = getenv(name);
+  if (!value || !*value) {
+    return NULL;
+  }
+  size_t length = 0;
+  for (const char* c = value; *c; c++) {
+    if (c[0] == '%' && c[1] == 'p') {
+      length += (size_t)snprintf(path + length, capacity - length, "%ld",
+                                 (long)getpid());
+      c++;
+    } else {
+      path[length++] = *c;
+    }
+    if (length + 1 >= capacity) {
+      return NULL;
+    }
+  }
+  path[length] = '\0';
+  return path;
+}
+
+// Options for the preloaded library come from the environment. Every event
+// of a whole process is too much for stdout, so the defaults are quieter.
+static WatchdogOptions w_preload_options_internal(void) {
+  WatchdogOptions options = w_default_options();
+  options.enable_verbose_log = w_preload_flag_internal("WATCHDOG_VERBOSE", 0);
+  options.log_to_file = w_preload_flag_internal("WATCHDOG_LOG_TO_FILE", 1);
+  if (w_preload_flag_internal("WATCHDOG_ASYNC", 0)) {
+    options.log_mode = WATCHDOG_LOG_ASYNC;
+  }
+  static char trace_path[PATH_MAX];
+  const char* trace_file =
+      w_preload_path_internal("WATCHDOG_TRACE", trace_path, sizeof trace_path);
+  if (trace_file) {
+    options.log_format = WATCHDOG_FORMAT_BINARY;
+    options.trace_file = trace_file;
+  }
+  options.canary_size =
+      w_preload_size_internal("WATCHDOG_CANARY_SIZE", options.canary_size);
+  options.sample_rate =
+      w_preload_size_internal("WATCHDOG_SAMPLE_RATE", options.sample_rate);
+  // A recording for tools/wdreplay needs every allocation and free, logged
+  // off the allocating threads without dropping any. Programs it executes
+  // would truncate the recording, so they only record when the path tells
+  // their traces apart with %p.
+  static char record_path[PATH_MAX];
+  const char* record_file = w_preload_path_internal(
+      "WATCHDOG_RECORD", record_path, sizeof record_path);
+  if (record_file && !strstr(getenv("WATCHDOG_RECORD"), "%p")) {
+    unsetenv("WATCHDOG_RECORD");
+  }
+  if (record_file) {
+    options.enable_verbose_log = true;
+    options.log_mode = WATCHDOG_LOG_ASYNC;
+    options.ring_full_policy = WATCHDOG_RING_BLOCK;
+    options.log_format = WATCHDOG_FORMAT_BINARY;
+    options.trace_file = record_file;
+    options.sample_rate = 0;
+  }
+  options.report_top_sites = w_preload_size_internal(
+      "WATCHDOG_TOP_SITES", options.report_top_sites);
+  options.report_leak_details = w_preload_size_internal(
+      "WATCHDOG_LEAK_DETAILS", options.report_leak_details);
+  options.stack_depth =
+      w_preload_size_internal("WATCHDOG_STACK_DEPTH", options.stack_depth);
+  options.lifetime_profile = w_preload_flag_internal("WATCHDOG_LIFETIMES", 0);
+  options.short_lived_ns = w_preload_size_internal("WATCHDOG_SHORT_LIVED_NS",
+                                                   options.short_lived_ns);
+  options.short_lived_allocations = w_preload_size_internal(
+      "WATCHDOG_SHORT_LIVED_ALLOCS", options.short_lived_allocations);
+  options.stats_interval_ms = w_preload_size_internal(
+      "WATCHDOG_STATS_INTERVAL", options.stats_interval_ms);
+  options.quarantine_bytes = w_preload_size_internal(
+      "WATCHDOG_QUARANTINE", options.quarantine_bytes);
+  options.quarantine_poison = (unsigned char)w_preload_size_internal(
+      "WATCHDOG_QUARANTINE_POISON", options.quarantine_poison);
+  options.quarantine_verify =
+      w_preload_flag_internal("WATCHDOG_QUARANTINE_VERIFY", 1);
+  options.scrub_interval_ms = w_preload_size_internal(
+      "WATCHDOG_SCRUB_INTERVAL", options.scrub_interval_ms);
+  options.scrub_blocks_per_tick = w_preload_size_internal(
+      "WATCHDOG_SCRUB_BLOCKS", options.scrub_blocks_per_tick);
+  options.guard_page_threshold = w_preload_size_internal(
+      "WATCHDOG_GUARD_PAGES", options.guard_page_threshold);
+  options.thread_cache_bytes = w_preload_size_internal(
+      "WATCHDOG_THREAD_CACHE", options.thread_cache_bytes);
+  options.snapshot_signal = (int)w_preload_size_internal(
+      "WATCHDOG_SNAPSHOT_SIGNAL", (size_t)options.snapshot_signal);
+  const char* snapshot_file = getenv("WATCHDOG_SNAPSHOT_FILE");
+  if (snapshot_file && *snapshot_file) {
+    options.snapshot_file = snapshot_file;
+  }
+  return options;
+}
+
+// Names a return-address call site: the object it is in as the file, and
+// symbol+offset (or the offset in the object) as the function.
+static void w_preload_describe_internal(WCS* site, const void* address) {
+  Dl_info info;
+  char func[256];
+  const char* file = "??";
+  if (dladdr(address, &info) && info.dli_fname) {
+    file = *info.dli_fname ? info.dli_fname : program_invocation_name;
+    if (info.dli_sname) {
+      snprintf(func, sizeof func, "%s+0x%tx", info.dli_sname,
+               (const BYTE*)address - (const BYTE*)info.dli_saddr);
+    } else {
+      snprintf(func, sizeof func, "0x%tx",
+               (const BYTE*)address - (const BYTE*)info.dli_fbase);
+    }
+  } else {
+    snprintf(func, sizeof func, "%p", address);
+  }
+  site->file = strdup(file);
+  site->func = strdup(func);
+}
+
+// The interposers below hand a request to watchdog only when this thread is
+// not already inside it; everything else goes to the system allocator. A
+// NULL file tells WCS_intern that `func` is the caller's return address.
+// Zero-byte requests are tracked as one byte, since callers of the system
+// allocator often treat NULL as out of memory.
+
+static void* w_preload_malloc_internal(size_t size, const void* caller) {
+  if (!w_preload_resolve_internal()) {
+    return w_bootstrap_alloc_internal(size);
+  }
+  if (w_reentry) {
+    return w_real_malloc(size);
+  }
+  w_reentry++;
+  void* ptr = w_malloc(size ? size : 1, NULL, 0, caller);
+  w_reentry--;
+  return ptr;
+}
+
+void* malloc(size_t size) {
+  return w_preload_malloc_internal(size, __builtin_return_address(0));
+}
+
+void* calloc(size_t count, size_t size) {
+  if (!w_preload_resolve_internal()) {
+    // The arena is static, so its memory is already zeroed.
+    return count && size > SIZE_MAX / count
+               ? NULL
+               : w_bootstrap_alloc_internal(count * size);
+  }
+  if (w_reentry) {
+    return w_real_calloc(count, size);
+  }
+  if (!count || !size) {
+    count = size = 1;
+  }
+  w_reentry++;
+  void* ptr = w_calloc(count, size, NULL, 0, __builtin_return_address(0));
+  w_reentry--;
+  return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+  // realloc(NULL, 0) is malloc(0), which callers expect to succeed.
+  if (!ptr) {
+    return w_preload_malloc_internal(size, __builtin_return_address(0));
+  }
+  if (w_bootstrap_owns_internal(ptr)) {
+    size_t old_size;
+    memcpy(&old_size, (BYTE*)ptr - W_BOOTSTRAP_HEADER, sizeof old_size);
+    void* moved = malloc(size);
+    if (moved) {
+      memcpy(moved, ptr, old_size < size ? old_size : size);
+    }
+    return moved;
+  }
+  if (!w_preload_resolve_internal()) {
+    return NULL;
+  }
+  if (w_reentry) {
+    return w_real_realloc(ptr, size);
+  }
+  w_reentry++;
+  void* moved = w_realloc(ptr, size, NULL, 0, __builtin_return_address(0));
+  w_reentry--;
+  return moved;
+}
+
+void free(void* ptr) {
+  if (!ptr || w_bootstrap_owns_internal(ptr)) {
+    return;
+  }
+  if (!w_preload_resolve_internal()) {
+    return;
+  }
+  if (w_reentry) {
+    w_real_free(ptr);
+    return;
+  }
+  w_reentry++;
+  w_free(ptr, NULL, 0, __builtin_return_address(0));
+  w_reentry--;
+}
+
+// Tracked blocks are 16-byte aligned. Stricter alignments are served by the
+// system allocator untracked; free passes them through as foreign blocks.
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  if (!alignment || alignment & (alignment - 1) ||
+      alignment % sizeof(void*)) {
+    return EINVAL;
+  }
+  if (alignment > CANARY_ALIGNMENT) {
+    if (!w_preload_resolve_internal() || !w_real_posix_memalign) {
+      return ENOMEM;
+    }
+    return w_real_posix_memalign(memptr, alignment, size);
+  }
+  void* ptr = w_preload_malloc_internal(size, __builtin_return_address(0));
+  if (!ptr) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  if (!alignment || alignment & (alignment - 1)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (alignment > CANARY_ALIGNMENT) {
+    if (!w_preload_resolve_internal() || !w_real_aligned_alloc) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    return w_real_aligned_alloc(alignment, size);
+  }
+  return w_preload_malloc_internal(size, __builtin_return_address(0));
+}
+
+// Like aligned_alloc, but glibc also takes alignments that are not powers of
+// two and rounds them up. valloc and pvalloc always ask for a page, so they
+// are left to the system allocator, like other page-aligned requests.
+void* memalign(size_t alignment, size_t size) {
+  if (alignment > CANARY_ALIGNMENT) {
+    if (!w_preload_resolve_internal() || !w_real_memalign) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    return w_real_memalign(alignment, size);
+  }
+  return w_preload_malloc_internal(size, __builtin_return_address(0));
+}
+
+// The system allocator would read watchdog's guards or tag as its chunk
+// header, so watchdog's blocks report their own size: the requested size for
+// tracked and counted blocks, since the guards follow it. Freed blocks
+// report 0.
+static size_t w_preload_usable_size_internal(void* ptr) {
+  if (!W_HAS(TRACKING)) {
+    WCH* header = w_counted_header_internal(ptr);
+    if (header) {
+      return header->size;
+    }
+    return w_real_malloc_usable_size(ptr);
+  }
+  if (w_unsampled_internal(ptr)) {
+    return w_real_malloc_usable_size((WUT*)ptr - 1) - sizeof(WUT);
+  }
+  void* original_ptr = (BYTE*)ptr - canary_size;
+  WS* shard = WS_for_internal(original_ptr);
+  WFR freed_record;
+  w_shard_lock_internal(shard);
+  size_t index;
+  size_t size;
+  if (WS_find(shard, original_ptr, &index)) {
+    size = shard->records.buffer[index].size;
+  } else if (WFH_find(&shard->history, original_ptr, &freed_record) ||
+             WQ_find(&shard->quarantine, original_ptr, &freed_record)) {
+    size = 0;
+  } else {
+    size = SIZE_MAX;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return size == SIZE_MAX ? w_real_malloc_usable_size(ptr) : size;
+}
+
+size_t malloc_usable_size(void* ptr) {
+  if (!ptr) {
+    return 0;
+  }
+  if (w_bootstrap_owns_internal(ptr)) {
+    size_t size;
+    memcpy(&size, (BYTE*)ptr - W_BOOTSTRAP_HEADER, sizeof size);
+    return size;
+  }
+  if (!w_preload_resolve_internal() || !w_real_malloc_usable_size) {
+    return 0;
+  }
+  if (w_reentry) {
+    return w_real_malloc_usable_size(ptr);
+  }
+  w_reentry++;
+  w_check_initialization_internal();
+  size_t size = w_preload_usable_size_internal(ptr);
+  w_reentry--;
+  return size;
+}
+
+#endif  // WATCHDOG_PRELOAD
@@ -5,6 +5,34 @@
 extern "C" {
 #endif  // __cplusplus
 
+// Features compiled into the library. A feature left out costs nothing at
+// run time: its code is removed, not skipped by a flag. Options that belong
+// to a missing feature are ignored.
+//   TRACKING  a record per block: leak report, double/invalid free and
+//             realloc detection, quarantine, guard pages, stacks, sampling.
+//             Without it, blocks carry a 16-byte header and only the global
+//             and per-site counters are kept.
+//   CANARIES  guard zones around each block (requires TRACKING).
+//   EVENTS    per-operation log lines and trace records (errors and leaks
+//             are always reported).
+//   LATENCY   latency histograms.
+// The presets below are built by `make counters`, `make leaks` and
+// `make full`, e.g. -DWATCHDOG_FEATURES=WATCHDOG_FEATURES_LEAKS.
+#define WATCHDOG_FEATURE_TRACKING (1 << 0)
+#define WATCHDOG_FEATURE_CANARIES (1 << 1)
+#define WATCHDOG_FEATURE_EVENTS (1 << 2)
+#define WATCHDOG_FEATURE_LATENCY (1 << 3)
+
+#define WATCHDOG_FEATURES_COUNTERS 0
+#define WATCHDOG_FEATURES_LEAKS WATCHDOG_FEATURE_TRACKING
+#define WATCHDOG_FEATURES_FULL                                              \
+  (WATCHDOG_FEATURE_TRACKING | WATCHDOG_FEATURE_CANARIES |                  \
+   WATCHDOG_FEATURE_EVENTS | WATCHDOG_FEATURE_LATENCY)
+
+#ifndef WATCHDOG_FEATURES
+#define WATCHDOG_FEATURES WATCHDOG_FEATURES_FULL
+#endif  // WATCHDOG_FEATURES
+
 // Option which clones all strings (file and func names) to prevent broken
 // references (useful in case when dynamic libraries are involved). This may
 // have performance and memory usage impact. Another option is to keep all
@@ -15,6 +43,87 @@ extern "C" {
 #define WATCHDOG_COPY_STRINGS 0
 #endif  // WATCHDOG_COPY_STRINGS
 
+// Number of freed allocations remembered after their tracking record is
+// reclaimed. Double frees and reallocs of freed pointers are reported with
+// the original call sites as long as the pointer is still in this history;
+// older ones are reported as untracked. Set to 0 to disable the history.
+#ifndef WATCHDOG_FREED_HISTORY_SIZE
+#define WATCHDOG_FREED_HISTORY_SIZE 4096
+#endif  // WATCHDOG_FREED_HISTORY_SIZE
+
+// Number of independently locked shards the tracking state is split into.
+// Blocks are assigned to a shard by pointer hash. Must be a power of two.
+#ifndef WATCHDOG_SHARDS
+#define WATCHDOG_SHARDS 16
+#endif  // WATCHDOG_SHARDS
+
+// Capacity of the call-site table. Every distinct (file, line, func) that
+// allocates or frees gets one entry; sites beyond the capacity are reported
+// as "??". Must be a power of two.
+#ifndef WATCHDOG_MAX_CALL_SITES
+#define WATCHDOG_MAX_CALL_SITES 16384
+#endif  // WATCHDOG_MAX_CALL_SITES
+
+// Most return addresses kept per allocation stack (see `stack_depth`), and
+// capacity of the depot that stores each distinct stack once. Allocations
+// whose stack does not fit in the depot are grouped by call site only. The
+// capacity must be a power of two.
+#ifndef WATCHDOG_MAX_STACK_DEPTH
+#define WATCHDOG_MAX_STACK_DEPTH 16
+#endif  // WATCHDOG_MAX_STACK_DEPTH
+
+#ifndef WATCHDOG_MAX_STACKS
+#define WATCHDOG_MAX_STACKS 16384
+#endif  // WATCHDOG_MAX_STACKS
+
+// Capacity of the table of live guarded blocks (see `guard_page_threshold`)
+// that the fault handler searches. Blocks beyond it are still guarded, but a
+// fault in one is not reported. Must be a power of two.
+#ifndef WATCHDOG_MAX_GUARDED_BLOCKS
+#define WATCHDOG_MAX_GUARDED_BLOCKS 4096
+#endif  // WATCHDOG_MAX_GUARDED_BLOCKS
+
+// Store a small validated header (check word, size, record position) at the
+// start of each block's leading canary. Free and realloc then find the record
+// through the header instead of the hash index. A header that fails
+// validation is treated as an untracked or corrupted block. The header takes
+// 32 bytes of the leading canary, which is grown to at least 48. Note that
+// this reads the memory in front of any aligned pointer passed to free/realloc
+// that lies between the lowest and highest tracked blocks, so freeing a wild
+// pointer or double freeing a block the system allocator already returned to
+// the OS can fault. Guarded blocks (see `guard_page_threshold`) keep their
+// header readable for the next WATCHDOG_MAX_GUARDED_BLOCKS releases.
+#ifndef WATCHDOG_INLINE_HEADER
+#define WATCHDOG_INLINE_HEADER 0
+#endif  // WATCHDOG_INLINE_HEADER
+
+// Set by `make preload`, which builds libwatchdog.so to be loaded with
+// LD_PRELOAD. The library defines malloc, calloc, realloc, free,
+// posix_memalign, aligned_alloc, memalign and malloc_usable_size itself,
+// names call sites after return addresses, reads its options from WATCHDOG_*
+// environment variables and passes blocks it did not allocate through to the
+// system allocator. valloc and pvalloc are left to the system allocator.
+#ifndef WATCHDOG_PRELOAD
+#define WATCHDOG_PRELOAD 0
+#endif  // WATCHDOG_PRELOAD
+
+// Largest padded block (data plus both guards) kept in the per-thread block
+// caches enabled by `thread_cache_bytes`. Must be a multiple of 16.
+#ifndef WATCHDOG_CACHE_MAX_BLOCK
+#define WATCHDOG_CACHE_MAX_BLOCK 1024
+#endif  // WATCHDOG_CACHE_MAX_BLOCK
+
+// Default number of guard bytes on each side of a block. Rounded up to a
+// multiple of 16 so user pointers keep the system allocator's alignment.
+#ifndef WATCHDOG_DEFAULT_CANARY_SIZE
+#define WATCHDOG_DEFAULT_CANARY_SIZE 64
+#endif  // WATCHDOG_DEFAULT_CANARY_SIZE
+
+// Default number of events the asynchronous log ring can hold.
+#ifndef WATCHDOG_DEFAULT_RING_CAPACITY
+#define WATCHDOG_DEFAULT_RING_CAPACITY 65536
+#endif  // WATCHDOG_DEFAULT_RING_CAPACITY
+
 //------------------------------------------------------------------------------
 // Includes
 //------------------------------------------------------------------------------
@@ -46,8 +155,151 @@ extern "C" {
 #define AEC_BOLD "\x1b[1m"
 #define AEC_DIM "\x1b[2m"
 
+typedef enum {
+  // Format and flush every event on the calling thread.
+  WATCHDOG_LOG_SYNC,
+  // Queue fixed-size binary events in a lock-free ring; a background thread
+  // formats and writes them in batches. The ring is fully drained when the
+  // logging options change and before the exit report is printed.
+  WATCHDOG_LOG_ASYNC,
+} WatchdogLogMode;
+
+// What an allocating thread does when the asynchronous ring is full. Error
+// events always wait for space, regardless of the policy.
+typedef enum {
+  // Discard the event and count it; the count is printed in the report.
+  WATCHDOG_RING_DROP,
+  // Yield until the writer thread frees a slot.
+  WATCHDOG_RING_BLOCK,
+} WatchdogRingPolicy;
+
+typedef enum {
+  // Human-readable lines on stdout or in watchdog.log.
+  WATCHDOG_FORMAT_TEXT,
+  // Fixed-size binary records in `trace_file` (see watchdog_trace.h), with
+  // call-site strings stored once. Errors and leaks are still echoed as text.
+  // Decode with tools/wdtrace.
+  WATCHDOG_FORMAT_BINARY,
+} WatchdogLogFormat;
+
+typedef struct {
+  bool enable_verbose_log;
+  bool log_to_file;
+  bool enable_color_output;
+  WatchdogLogMode log_mode;
+  size_t ring_capacity;  // in events, rounded up to a power of two
+  WatchdogRingPolicy ring_full_policy;
+  WatchdogLogFormat log_format;
+  const char* trace_file;  // used with WATCHDOG_FORMAT_BINARY
+  // Guard bytes on each side of a block, rounded up to a multiple of 16.
+  // Small guards are cheap; large ones catch overruns that skip ahead. Only
+  // the first initialization applies it, since live blocks depend on it.
+  size_t canary_size;
+  // Mean number of bytes allocated between fully tracked allocations; 0
+  // tracks everything. Allocations that are not sampled get no canaries,
+  // record or log events, only a 16-byte tag, and the report adds scaled
+  // estimates. Only the first initialization applies it.
+  size_t sample_rate;
+  // Number of call sites listed in each of the report's top-site tables (by
+  // bytes, by allocation count and by bytes still live at exit); 0 omits
+  // the tables.
+  size_t report_top_sites;
+  // Leaked blocks logged individually at exit; the rest are only counted in
+  // the report's per-site leak table, which lists every leaking call site by
+  // bytes, with block counts and the smallest and largest block. The binary
+  // trace always gets a record for every leak.
+  size_t report_leak_details;
+  // Return addresses captured for each tracked allocation, up to
+  // WATCHDOG_MAX_STACK_DEPTH; 0 disables capture. Leaks are then grouped by
+  // stack instead of by call site and printed with their frames, which are
+  // symbolized only when the report is written. Unwinding costs about a
+  // microsecond per allocation, so this pairs well with sampling.
+  size_t stack_depth;
+  // Record how long each tracked block lives, per allocating call site. The
+  // report then lists the sites where most blocks are short-lived: freed
+  // within `short_lived_ns` nanoseconds or within `short_lived_allocations`
+  // allocations by the whole process. Lifetimes run from the allocation, or
+  // the last realloc, to the free.
+  bool lifetime_profile;
+  size_t short_lived_ns;
+  size_t short_lived_allocations;
+  // Log a stats line (usage, peak, live blocks, alloc and free rates) every
+  // this many milliseconds from a background thread; 0 disables it.
+  size_t stats_interval_ms;
+  // Bytes of freed blocks held back from the system allocator, filled with
+  // `quarantine_poison`; 0 disables the quarantine. The oldest blocks are
+  // released first, and with `quarantine_verify` their poison is checked on
+  // the way out so writes after free are reported with the allocating and
+  // freeing call sites. The budget is split evenly across the shards. Only
+  // the first initialization applies the poison byte.
+  size_t quarantine_bytes;
+  unsigned char quarantine_poison;
+  bool quarantine_verify;
+  // Check the guards of live blocks from a background thread every this many
+  // milliseconds, `scrub_blocks_per_tick` blocks at a time; 0 disables it.
+  // Damage is reported once per block with its allocation site, long before
+  // a free would find it. The thread runs at idle priority where supported
+  // and holds a shard lock for at most one batch.
+  size_t scrub_interval_ms;
+  size_t scrub_blocks_per_tick;
+  // Blocks of at least this many bytes get their own mapping, with the data
+  // ending at an inaccessible page: reads and writes past the end fault at
+  // once, and the fault is reported with the block's allocation site before
+  // the process dies. Costs a page plus rounding per block; 0 disables it.
+  // Only the first initialization applies it.
+  size_t guard_page_threshold;
+  // Bytes of released blocks each thread keeps for its own reuse instead of
+  // returning them to the system allocator; 0 disables the cache. Only
+  // blocks of up to WATCHDOG_CACHE_MAX_BLOCK padded bytes are kept, in
+  // 16-byte size classes. Reused blocks get fresh guards, and double and
+  // untracked frees are still caught, since a cached block has no record.
+  // Only the first initialization applies it.
+  size_t thread_cache_bytes;
+  // Signal (e.g. SIGUSR2) that appends a snapshot diff to `snapshot_file`:
+  // live blocks and bytes per call site, and the sites that grew since the
+  // previous signal. Handled on a background thread; 0 installs no handler.
+  int snapshot_signal;
+  const char* snapshot_file;
+} WatchdogOptions;
+
+// Point-in-time counters returned by w_get_stats. With sampling, the totals
+// cover sampled allocations only and the estimates are scaled up; without
+// it, the estimates equal the exact values.
+typedef struct {
+  uint64_t timestamp;  // CLOCK_MONOTONIC nanoseconds
+  size_t total_allocations;
+  size_t total_frees;
+  size_t live_allocations;
+  size_t current_usage;  // in bytes
+  size_t peak_usage;
+  size_t estimated_usage;
+  size_t estimated_peak_usage;
+  size_t dropped_events;  // asynchronous log events discarded so far
+} WatchdogStatsSnapshot;
+
+// Returns the options w_init starts from: verbose, synchronous text logging
+// to stdout without color.
+extern WatchdogOptions w_default_options(void);
+extern void w_init_with_options(const WatchdogOptions* options);
 extern void w_init(bool enable_verbose_log, bool log_to_file,
                    bool enable_color_output);
+// Reads the counters without blocking allocating threads. Safe to call from
+// any thread at any time, including before initialization.
+extern WatchdogStatsSnapshot w_get_stats(void);
+// Live blocks and bytes of every call site at one point in time. Taking one
+// reads the per-site counters without blocking allocating threads, and costs
+// the same however many blocks are live. With sampling, it covers sampled
+// allocations only.
+typedef struct WatchdogSnapshot WatchdogSnapshot;
+// Returns NULL if the snapshot cannot be allocated. Release it with
+// w_snapshot_free.
+extern WatchdogSnapshot* w_snapshot(void);
+// Logs the totals of both snapshots and the call sites whose live bytes grew
+// from `before` to `after`, largest growth first (up to `report_top_sites`).
+// A NULL `before` stands for an empty heap.
+extern void w_snapshot_diff(const WatchdogSnapshot* before,
+                            const WatchdogSnapshot* after);
+extern void w_snapshot_free(WatchdogSnapshot* snapshot);
 extern void* w_malloc(size_t size, const char* file, const int line,
                       const char* func);
 extern void* w_realloc(void* old_ptr, size_t size, const char* file,
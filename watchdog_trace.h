@@ -0,0 +1,196 @@
+#ifndef WATCHDOG_TRACE_H_
+#define WATCHDOG_TRACE_H_
+
+// On-disk layout of the binary trace written with
+// WATCHDOG_FORMAT_BINARY, shared by watchdog.c and tools/wdtrace.c.
+//
+//   [WatchdogTraceHeader]                      offset 0
+//   [WatchdogTraceRecord] * record_count       offset records_offset
+//   [WatchdogTraceSite] * site_count           offset sites_offset
+//   [NUL-terminated file/func strings]         offset strings_offset
+//
+// Records are fixed-size and naturally aligned so the file can be mapped and
+// indexed directly. The call-site table is appended when the trace is closed;
+// a trace cut short by a crash has record_count == 0 and no sites, and readers
+// recover the records from the file size.
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define WATCHDOG_TRACE_MAGIC "WDTRACE"
+#define WATCHDOG_TRACE_VERSION 1
+
+// Records start here; the header is zero-padded up to this offset.
+#define WATCHDOG_TRACE_RECORDS_OFFSET 128
+
+// Call-site ids stay below this; readers index their site tables by id.
+#define WATCHDOG_TRACE_MAX_SITES (1u << 20)
+
+typedef enum {
+  WATCHDOG_EVENT_MALLOC,
+  WATCHDOG_EVENT_CALLOC,
+  WATCHDOG_EVENT_REALLOC,
+  WATCHDOG_EVENT_FREE,
+  WATCHDOG_EVENT_LEAK,
+  WATCHDOG_EVENT_ALLOCATED,
+  WATCHDOG_EVENT_FREED,
+  WATCHDOG_EVENT_ERROR,
+  WATCHDOG_EVENT_COUNT,
+} WatchdogEventType;
+
+typedef enum {
+  WATCHDOG_ERROR_OUT_OF_BOUNDS,
+  WATCHDOG_ERROR_OUT_OF_MEMORY,
+  WATCHDOG_ERROR_CALLOC_OVERFLOW,
+  WATCHDOG_ERROR_DOUBLE_FREE,
+  WATCHDOG_ERROR_UNTRACKED_FREE,
+  WATCHDOG_ERROR_FREED_REALLOC,
+  WATCHDOG_ERROR_UNTRACKED_REALLOC,
+  WATCHDOG_ERROR_USE_AFTER_FREE,
+  WATCHDOG_ERROR_GUARD_PAGE,
+  WATCHDOG_ERROR_COUNT,
+} WatchdogError;
+
+typedef struct {
+  char magic[8];  // WATCHDOG_TRACE_MAGIC, NUL padded
+  uint32_t version;
+  uint32_t record_size;  // sizeof(WatchdogTraceRecord)
+  uint64_t record_count;
+  uint64_t records_offset;
+  uint64_t sites_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint32_t site_count;
+  uint32_t reserved;
+  int64_t realtime_offset;  // add to a timestamp to get CLOCK_REALTIME ns
+} WatchdogTraceHeader;
+
+_Static_assert(sizeof(WatchdogTraceHeader) <= WATCHDOG_TRACE_RECORDS_OFFSET,
+               "trace header overlaps the records");
+
+// One event. For WATCHDOG_EVENT_ERROR, `size` holds the WatchdogError code;
+// out-of-bounds errors also carry the block in `ptr` and, in `aux`, the first
+// overwritten byte as a signed distance (negative: before the start,
+// otherwise: past the end). Use-after-free errors carry the freed block in
+// `ptr` and the offset of the first modified byte in `aux`; guard page errors
+// carry the block and the faulting address's distance past its end. For
+// WATCHDOG_EVENT_REALLOC, `aux` holds the user pointer that was resized.
+typedef struct {
+  uint64_t timestamp;  // CLOCK_MONOTONIC nanoseconds
+  uint64_t ptr;        // user pointer
+  uint64_t size;
+  uint64_t aux;
+  uint32_t site;  // call-site id, 0 when unknown
+  uint32_t thread;
+  uint32_t op;  // WatchdogEventType
+  uint32_t reserved;
+} WatchdogTraceRecord;
+
+typedef struct {
+  uint32_t id;
+  uint32_t line;
+  uint32_t file_offset;  // relative to strings_offset
+  uint32_t func_offset;
+} WatchdogTraceSite;
+
+// Whether a closed trace of `length` bytes, with a header of the supported
+// version, is laid out as described above: sections in order and in bounds,
+// site ids below WATCHDOG_TRACE_MAX_SITES, and site strings that start inside
+// the NUL-terminated string blob.
+static inline bool watchdog_trace_valid(const unsigned char* base,
+                                        size_t length) {
+  const WatchdogTraceHeader* header = (const WatchdogTraceHeader*)base;
+  if (header->records_offset > header->sites_offset ||
+      header->sites_offset > header->strings_offset ||
+      header->strings_offset > length ||
+      header->strings_size > length - header->strings_offset ||
+      header->records_offset % _Alignof(WatchdogTraceRecord) ||
+      header->sites_offset % _Alignof(WatchdogTraceSite) ||
+      (header->sites_offset - header->records_offset) /
+              sizeof(WatchdogTraceRecord) < header->record_count ||
+      header->site_count > (header->strings_offset - header->sites_offset) /
+                               sizeof(WatchdogTraceSite)) {
+    return false;
+  }
+  const char* strings = (const char*)base + header->strings_offset;
+  if (header->site_count &&
+      (!header->strings_size || strings[header->strings_size - 1] != '\0')) {
+    return false;
+  }
+  const WatchdogTraceSite* sites =
+      (const WatchdogTraceSite*)(base + header->sites_offset);
+  for (uint32_t i = 0; i < header->site_count; i++) {
+    if (sites[i].id >= WATCHDOG_TRACE_MAX_SITES ||
+        sites[i].file_offset >= header->strings_size ||
+        sites[i].func_offset >= header->strings_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline const char* watchdog_event_name(uint32_t op) {
+  static const char* const names[WATCHDOG_EVENT_COUNT] = {
+      "MALLOC", "CALLOC", "REALLOC", "FREE",
+      "LEAK",   "ALLOCATED", "FREED", "ERROR",
+  };
+  return op < WATCHDOG_EVENT_COUNT ? names[op] : "UNKNOWN";
+}
+
+static inline const char* watchdog_error_message(uint64_t error) {
+  static const char* const messages[WATCHDOG_ERROR_COUNT] = {
+      "Out of bounds access.",
+      "Out of memory error.",
+      "Calloc parameter overflow.",
+      "Double free error.",
+      "Attempt to free unallocated/untracked memory.",
+      "Attempt to reallocate a freed pointer.",
+      "Attempt to reallocate unallocated/untracked memory.",
+      "Write to freed memory.",
+      "Guard page access.",
+  };
+  return error < WATCHDOG_ERROR_COUNT ? messages[error] : "Unknown error.";
+}
+
+#define WATCHDOG_ERROR_TEXT_SIZE 160
+
+// Message for an ERROR record, with the damaged side and offset for
+// out-of-bounds errors that carry them.
+static inline void watchdog_error_text(const WatchdogTraceRecord* record,
+                                       char* buffer, size_t length) {
+  const char* message = watchdog_error_message(record->size);
+  int64_t offset = (int64_t)record->aux;
+  if (record->size == WATCHDOG_ERROR_USE_AFTER_FREE && record->ptr) {
+    snprintf(buffer, length,
+             "%s %p was modified at start+%" PRId64 " after it was freed.",
+             message, (void*)(uintptr_t)record->ptr, offset);
+  } else if (record->size == WATCHDOG_ERROR_GUARD_PAGE && record->ptr) {
+    snprintf(buffer, length,
+             "%s Overflow of %p: faulting access at end+%" PRId64 ".",
+             message, (void*)(uintptr_t)record->ptr, offset);
+  } else if (record->size != WATCHDOG_ERROR_OUT_OF_BOUNDS || !record->ptr) {
+    snprintf(buffer, length, "%s", message);
+  } else if (offset < 0) {
+    snprintf(buffer, length,
+             "%s Underflow of %p: first overwritten byte at start-%" PRId64
+             ".",
+             message, (void*)(uintptr_t)record->ptr, -offset);
+  } else {
+    snprintf(buffer, length,
+             "%s Overflow of %p: first overwritten byte at end+%" PRId64 ".",
+             message, (void*)(uintptr_t)record->ptr, offset);
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif  // __cplusplus
+
+#endif  // WATCHDOG_TRACE_H_